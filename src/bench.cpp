@@ -0,0 +1,308 @@
+// Times the ray-triangle tests on random triangles and rays and checks that they find the same
+// hits: the plane-then-edge test that Moller-Trumbore replaced, rayTriangleIntersection, and
+// the block test used for BVH leaves.
+
+#include "bvh.h"
+#include "raytracer.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+static void usage() {
+	std::cerr << "Usage: bench [--triangles=N] [--rays=N] [--repeat=N]\n";
+}
+
+// the tests may disagree on rays passing this close to an edge, in barycentric coordinates
+const double EDGE_TOLERANCE = 1e-4;
+
+// the tests find t in different ways, so hits at the same place differ by up to this much relative to t
+const float T_TOLERANCE = 1e-4f;
+
+// A triangle as the plane-then-edge test stored it, with its corners, edges and normal precomputed.
+struct PlaneEdgeTriangle {
+	point3 a, b, c;
+	glm::vec3 ab, bc, ca;
+	glm::vec3 n; // normalized
+};
+
+/*
+the plane-then-edge test Moller-Trumbore replaced: the ray meets the triangle's plane at a point
+inside all three edges, points on an edge are missed
+	e: origin of ray
+	s: intersection of ray
+	triangle: triangle with precomputed edges and normalized normal
+	t: output t value for intersection
+*/
+static bool planeEdgeIntersection(const point3 &e, const point3 &s, const PlaneEdgeTriangle &triangle, float &t) {
+	const glm::vec3 &n = triangle.n;
+	glm::vec3 d = s - e;
+
+	float denominator = glm::dot(n, d);
+	if (denominator == 0)
+		return false;
+
+	float planeT = glm::dot(n, triangle.a - e) / denominator;
+	if (planeT < 0)
+		return false;
+
+	point3 x = e + d * planeT;
+
+	if (glm::dot(glm::cross(triangle.ab, x - triangle.a), n) <= 0)
+		return false;
+	if (glm::dot(glm::cross(triangle.bc, x - triangle.b), n) <= 0)
+		return false;
+	if (glm::dot(glm::cross(triangle.ca, x - triangle.c), n) <= 0)
+		return false;
+
+	t = planeT;
+	return true;
+}
+
+/*
+how far inside the triangle the ray's line passes, found in double precision
+	e: origin of ray
+	s: intersection of ray
+	triangle: triangle
+	returns the smallest barycentric coordinate of the point, negative outside the triangle
+*/
+static double edgeDistance(const point3 &e, const point3 &s, const Triangle &triangle) {
+	glm::dvec3 d = glm::dvec3(s) - glm::dvec3(e);
+	glm::dvec3 e1(triangle.e1), e2(triangle.e2);
+	glm::dvec3 p = glm::cross(d, e2);
+
+	double determinant = glm::dot(e1, p);
+	if (determinant == 0)
+		return 0;
+
+	glm::dvec3 toOrigin = glm::dvec3(e) - glm::dvec3(triangle.a);
+	double u = glm::dot(toOrigin, p) / determinant;
+	double v = glm::dot(d, glm::cross(toOrigin, e1)) / determinant;
+	return std::min(std::min(u, v), 1 - u - v);
+}
+
+// Hits of one test compared with those of another.
+struct Agreement {
+	long long same; // both hit at about the same t, or both missed
+	long long atEdges; // not the same, with the ray at an edge
+	long long different;
+
+	Agreement() : same(0), atEdges(0), different(0) {}
+};
+
+/*
+compare the result of two tests on one ray and triangle
+	agreement: counts to add to
+	hitA, tA: whether the first test hit and its t
+	hitB, tB: whether the second test hit and its t
+	edge: edgeDistance of the ray and triangle
+*/
+static void compareHits(Agreement &agreement, bool hitA, float tA, bool hitB, float tB, double edge) {
+	if (hitA == hitB && (!hitA || std::fabs(tA - tB) <= T_TOLERANCE * std::max(tA, tB))) {
+		agreement.same++;
+	}
+	else if (std::fabs(edge) < EDGE_TOLERANCE) {
+		agreement.atEdges++;
+	}
+	else {
+		agreement.different++;
+	}
+}
+
+static void printAgreement(const char *name, const Agreement &agreement) {
+	std::cout << name << ": " << agreement.same << " agree, " << agreement.atEdges << " differ at an edge, " << agreement.different << " differ\n";
+}
+
+/*
+time a test over every ray and triangle, keeping the best of several runs
+	repeat: number of runs
+	tests: number of rays times triangles tested in a run
+	test: runs the test once over everything, returning the number of hits
+	hits: output number of hits found
+	returns the best time per ray and triangle tested, in nanoseconds
+*/
+template <class Test>
+static double timeTest(int repeat, double tests, Test test, long long &hits) {
+	double best = 0;
+
+	for (int run = 0; run < repeat; run++) {
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		hits = test();
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		best = run == 0 ? seconds : std::min(best, seconds);
+	}
+	return best / tests * 1e9;
+}
+
+int main(int argc, char **argv) {
+	int triangleCount = 4096, rayCount = 2048;
+	int repeat = 3;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+
+		if (arg.compare(0, 12, "--triangles=") == 0) {
+			triangleCount = atoi(arg.c_str() + 12);
+		}
+		else if (arg.compare(0, 7, "--rays=") == 0) {
+			rayCount = atoi(arg.c_str() + 7);
+		}
+		else if (arg.compare(0, 9, "--repeat=") == 0) {
+			repeat = atoi(arg.c_str() + 9);
+		}
+		else {
+			std::cerr << "Unknown option " << arg << std::endl;
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+	if (triangleCount < 1 || rayCount < 1 || repeat < 1) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	// small triangles scattered in front of the eye, and rays from the eye through a square
+	// covering them, so that a few percent of the tests hit
+	std::minstd_rand random(1);
+	std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+
+	std::vector<Triangle> triangles(triangleCount);
+	std::vector<PlaneEdgeTriangle> planeEdgeTriangles(triangleCount);
+	for (int i = 0; i < triangleCount; i++) {
+		point3 a(uniform(random), uniform(random), uniform(random) - 3.0f);
+		point3 b = a + 0.3f * point3(uniform(random), uniform(random), uniform(random));
+		point3 c = a + 0.3f * point3(uniform(random), uniform(random), uniform(random));
+
+		Triangle &triangle = triangles[i];
+		triangle.a = a;
+		triangle.e1 = b - a;
+		triangle.e2 = c - a;
+		triangle.n = glm::normalize(glm::cross(triangle.e1, triangle.e2));
+		triangle.material = 0;
+
+		PlaneEdgeTriangle &old = planeEdgeTriangles[i];
+		old.a = a;
+		old.b = b;
+		old.c = c;
+		old.ab = b - a;
+		old.bc = c - b;
+		old.ca = a - c;
+		old.n = triangle.n;
+	}
+
+	// the triangles in order, TRIANGLE_BLOCK_SIZE to a block, with empty lanes in the last one
+	std::vector<TriangleBlock> blocks((triangleCount + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE);
+	for (size_t b = 0; b < blocks.size(); b++) {
+		TriangleBlock &block = blocks[b];
+
+		for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; lane++) {
+			size_t i = b * TRIANGLE_BLOCK_SIZE + lane;
+			Triangle triangle = {};
+			if (i < triangles.size()) {
+				triangle = triangles[i];
+			}
+
+			block.ax[lane] = triangle.a.x; block.ay[lane] = triangle.a.y; block.az[lane] = triangle.a.z;
+			block.e1x[lane] = triangle.e1.x; block.e1y[lane] = triangle.e1.y; block.e1z[lane] = triangle.e1.z;
+			block.e2x[lane] = triangle.e2.x; block.e2y[lane] = triangle.e2.y; block.e2z[lane] = triangle.e2.z;
+			block.primitive[lane] = i < triangles.size() ? int(i) : -1;
+		}
+	}
+
+	point3 e(0.0f, 0.0f, 0.0f);
+	std::vector<point3> targets(rayCount);
+	for (int r = 0; r < rayCount; r++) {
+		targets[r] = point3(uniform(random), uniform(random), -1.0f);
+	}
+
+	double tests = double(rayCount) * triangleCount;
+	long long planeEdgeHits, mollerHits, blockHits;
+
+	double planeEdgeTime = timeTest(repeat, tests, [&]() {
+		long long hits = 0;
+		float t;
+		for (int r = 0; r < rayCount; r++) {
+			for (int i = 0; i < triangleCount; i++) {
+				hits += planeEdgeIntersection(e, targets[r], planeEdgeTriangles[i], t);
+			}
+		}
+		return hits;
+	}, planeEdgeHits);
+
+	double mollerTime = timeTest(repeat, tests, [&]() {
+		long long hits = 0;
+		float t, u, v;
+		for (int r = 0; r < rayCount; r++) {
+			for (int i = 0; i < triangleCount; i++) {
+				hits += rayTriangleIntersection(e, targets[r], triangles[i], t, u, v);
+			}
+		}
+		return hits;
+	}, mollerHits);
+
+	// the block test finds the closest hit in each block, so it counts blocks hit
+	double blockTime = timeTest(repeat, tests, [&]() {
+		long long hits = 0;
+		float t;
+		int lane;
+		for (int r = 0; r < rayCount; r++) {
+			glm::vec3 d = targets[r] - e;
+			for (size_t b = 0; b < blocks.size(); b++) {
+				hits += rayTriangleBlockIntersection(blocks[b], e, d, 0.0f, FLT_MAX, t, lane);
+			}
+		}
+		return hits;
+	}, blockHits);
+
+	std::cout << triangleCount << " triangles, " << rayCount << " rays, best of " << repeat << " runs\n";
+	std::cout << "Plane then edges: " << planeEdgeTime << " ns per test, " << planeEdgeHits << " hits\n";
+	std::cout << "Moller-Trumbore: " << mollerTime << " ns per test, " << mollerHits << " hits\n";
+	std::cout << "Blocks of " << TRIANGLE_BLOCK_SIZE << ": " << blockTime << " ns per triangle, " << blockHits << " blocks hit\n";
+
+	// every test is checked against Moller-Trumbore, the block test by the closest hit in each block
+	Agreement planeEdgeAgreement, blockAgreement;
+	for (int r = 0; r < rayCount; r++) {
+		const point3 &s = targets[r];
+		glm::vec3 d = s - e;
+
+		for (size_t b = 0; b < blocks.size(); b++) {
+			bool closestHit = false;
+			float closestT = FLT_MAX;
+			double closestEdge = 1;
+
+			for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE && blocks[b].primitive[lane] >= 0; lane++) {
+				int i = blocks[b].primitive[lane];
+				float t = 0, oldT = 0, u, v;
+				bool hit = rayTriangleIntersection(e, s, triangles[i], t, u, v) && t > 0.0f;
+				bool oldHit = planeEdgeIntersection(e, s, planeEdgeTriangles[i], oldT);
+				double edge = edgeDistance(e, s, triangles[i]);
+				compareHits(planeEdgeAgreement, oldHit, oldT, hit, t, edge);
+
+				// a ray at the edge of any triangle in the block may change which one is closest
+				if (std::fabs(edge) < std::fabs(closestEdge)) {
+					closestEdge = edge;
+				}
+				if (hit && t < closestT) {
+					closestHit = true;
+					closestT = t;
+				}
+			}
+
+			float blockT = 0;
+			int lane;
+			bool blockHit = rayTriangleBlockIntersection(blocks[b], e, d, 0.0f, FLT_MAX, blockT, lane);
+			compareHits(blockAgreement, closestHit, closestT, blockHit, blockT, closestEdge);
+		}
+	}
+
+	printAgreement("Plane then edges against Moller-Trumbore", planeEdgeAgreement);
+	printAgreement("Blocks against Moller-Trumbore", blockAgreement);
+
+	return planeEdgeAgreement.different == 0 && blockAgreement.different == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,816 @@
+/*
+	Bounding volume hierarchy
+	Built top-down with the surface area heuristic over spheres and triangles,
+	either by sweeping every split (serial) or by binning (parallel). Instanced
+	meshes get a tree each, and their instances are primitives of the scene's tree.
+*/
+
+#include "bvh.h"
+#include "scene.h"
+#include "tasks.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <iostream>
+#include <string>
+
+BVHBuilder bvhBuilder = BINNED_SAH_BUILDER;
+int bvhWidth = 4;
+bool useTriangleBlocks = true;
+
+// relative costs of visiting a node and intersecting a primitive for the SAH
+const float TRAVERSAL_COST = 1.0f;
+const float INTERSECTION_COST = 1.0f;
+
+// largest leaf the builder will make if splitting is not worth it
+const int MAX_LEAF_SIZE = 8;
+
+// number of bins per axis for the binned builder
+const int BIN_COUNT = 16;
+
+// nodes with more primitives than this build their children as separate tasks
+const int PARALLEL_SUBTREE_SIZE = 4096;
+
+// nodes with more primitives than this also bin their primitives in parallel chunks
+const int PARALLEL_BIN_SIZE = 65536;
+
+struct BuildPrimitive {
+	AABB bounds;
+	glm::vec3 centroid;
+	int id;
+};
+
+// Shared by every task of a build. Child pairs are allocated with an atomic
+// counter so subtrees can be built concurrently, and every node covers a
+// contiguous range of prims so leaves just record that range.
+struct BuildState {
+	std::vector<BuildPrimitive> prims;
+	MappedArray<BVHNode> *nodes;
+	std::atomic<int> nodeCount;
+	TaskGroup tasks;
+};
+
+struct Bin {
+	AABB bounds;
+	int count;
+};
+
+static AABB emptyBox() {
+	AABB box;
+	box.min = glm::vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+	box.max = glm::vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	return box;
+}
+
+static void grow(AABB &box, const AABB &other) {
+	box.min = glm::min(box.min, other.min);
+	box.max = glm::max(box.max, other.max);
+}
+
+static void grow(AABB &box, const glm::vec3 &p) {
+	box.min = glm::min(box.min, p);
+	box.max = glm::max(box.max, p);
+}
+
+static float surfaceArea(const AABB &box) {
+	glm::vec3 d = box.max - box.min;
+	return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+/*
+get the bounding box of a sphere or triangle
+	scene: compiled scene
+	primitive: primitive id (planes are not allowed)
+*/
+AABB primitiveBounds(const Scene &scene, int primitive) {
+	AABB box;
+	int i = primitive;
+
+	if (i < int(scene.spheres.size())) {
+		const Sphere &sphere = scene.spheres[i];
+		box.min = sphere.c - glm::vec3(sphere.R, sphere.R, sphere.R);
+		box.max = sphere.c + glm::vec3(sphere.R, sphere.R, sphere.R);
+		return box;
+	}
+	i -= int(scene.spheres.size()) + int(scene.planes.size());
+
+	const Triangle &triangle = scene.triangles[i];
+	point3 b = triangle.a + triangle.e1;
+	point3 c = triangle.a + triangle.e2;
+	box.min = glm::min(triangle.a, glm::min(b, c));
+	box.max = glm::max(triangle.a, glm::max(b, c));
+	return box;
+}
+
+/*
+get the world bounding box of an instance, which holds the corners of its mesh's box
+	instance: instance
+	meshBounds: bounds of the mesh in object space
+*/
+static AABB instanceBounds(const Instance &instance, const AABB &meshBounds) {
+	AABB box = emptyBox();
+
+	for (int corner = 0; corner < 8; corner++) {
+		glm::vec3 p((corner & 1) ? meshBounds.max.x : meshBounds.min.x,
+			(corner & 2) ? meshBounds.max.y : meshBounds.min.y,
+			(corner & 4) ? meshBounds.max.z : meshBounds.min.z);
+		grow(box, instance.toWorld * p + instance.toWorldOffset);
+	}
+	return box;
+}
+
+/*
+SAH cost of intersecting n primitives in a leaf; with triangle blocks a whole block
+costs about as much as one triangle
+	n: number of primitives
+*/
+static float leafCost(int n) {
+	if (useTriangleBlocks) {
+		return INTERSECTION_COST * ((n + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE);
+	}
+	return INTERSECTION_COST * n;
+}
+
+static void makeLeaf(BuildState &state, int nodeIndex, int begin, int end) {
+	BVHNode &node = (*state.nodes)[nodeIndex];
+	node.offset = begin;
+	node.count = end - begin;
+}
+
+static int allocateChildren(BuildState &state, int nodeIndex) {
+	int children = state.nodeCount.fetch_add(2);
+	BVHNode &node = (*state.nodes)[nodeIndex];
+	node.offset = children;
+	node.count = 0;
+	return children;
+}
+
+/*
+recursively build a node, sweeping every split position along every axis
+	state: build state
+	nodeIndex: node to fill in (already allocated)
+	begin, end: range of prims under this node
+	depth: depth of this node
+*/
+static void buildSweep(BuildState &state, int nodeIndex, int begin, int end, int depth) {
+	std::vector<BuildPrimitive> &prims = state.prims;
+	int n = end - begin;
+
+	AABB bounds = emptyBox();
+	for (int i = begin; i < end; i++) {
+		grow(bounds, prims[i].bounds);
+	}
+	(*state.nodes)[nodeIndex].bounds = bounds;
+
+	if (n == 1 || depth >= BVH_MAX_DEPTH) {
+		makeLeaf(state, nodeIndex, begin, end);
+		return;
+	}
+
+	// costs are compared scaled by the parent surface area
+	float parentArea = surfaceArea(bounds);
+	float bestCost = FLT_MAX;
+	int bestAxis = -1;
+	int bestSplit = 0;
+	std::vector<float> rightArea(n);
+
+	for (int axis = 0; axis < 3; axis++) {
+		std::sort(prims.begin() + begin, prims.begin() + end, [axis](const BuildPrimitive &a, const BuildPrimitive &b) {
+			return a.centroid[axis] < b.centroid[axis];
+		});
+
+		AABB right = emptyBox();
+		for (int i = n - 1; i > 0; i--) {
+			grow(right, prims[begin + i].bounds);
+			rightArea[i] = surfaceArea(right);
+		}
+
+		AABB left = emptyBox();
+		for (int i = 1; i < n; i++) {
+			grow(left, prims[begin + i - 1].bounds);
+			float cost = TRAVERSAL_COST * parentArea + surfaceArea(left) * leafCost(i) + rightArea[i] * leafCost(n - i);
+
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = i;
+			}
+		}
+	}
+
+	if (bestCost >= leafCost(n) * parentArea && n <= MAX_LEAF_SIZE) {
+		makeLeaf(state, nodeIndex, begin, end);
+		return;
+	}
+
+	if (bestAxis != 2) {
+		std::sort(prims.begin() + begin, prims.begin() + end, [bestAxis](const BuildPrimitive &a, const BuildPrimitive &b) {
+			return a.centroid[bestAxis] < b.centroid[bestAxis];
+		});
+	}
+
+	int children = allocateChildren(state, nodeIndex);
+	buildSweep(state, children, begin, begin + bestSplit, depth + 1);
+	buildSweep(state, children + 1, begin + bestSplit, end, depth + 1);
+}
+
+static int binIndex(const glm::vec3 &centroid, int axis, const AABB &centroidBounds, float scale) {
+	int b = int((centroid[axis] - centroidBounds.min[axis]) * scale);
+	return std::min(std::max(b, 0), BIN_COUNT - 1);
+}
+
+/*
+find the bounds and centroid bounds of a range of prims
+	state: build state
+	begin, end: range of prims
+	bounds: output bounds of the prims
+	centroidBounds: output bounds of the prim centroids
+*/
+static void rangeBounds(BuildState &state, int begin, int end, AABB &bounds, AABB &centroidBounds) {
+	bounds = emptyBox();
+	centroidBounds = emptyBox();
+
+	for (int i = begin; i < end; i++) {
+		grow(bounds, state.prims[i].bounds);
+		grow(centroidBounds, state.prims[i].centroid);
+	}
+}
+
+/*
+add a range of prims to the bins of all three axes
+	state: build state
+	begin, end: range of prims
+	centroidBounds: centroid bounds of the node being split
+	scale: BIN_COUNT / extent of the centroid bounds, per axis
+	bins: bins to add to, BIN_COUNT per axis
+*/
+static void binRange(BuildState &state, int begin, int end, const AABB &centroidBounds, const glm::vec3 &scale, Bin bins[3][BIN_COUNT]) {
+	for (int i = begin; i < end; i++) {
+		const BuildPrimitive &prim = state.prims[i];
+
+		for (int axis = 0; axis < 3; axis++) {
+			Bin &bin = bins[axis][binIndex(prim.centroid, axis, centroidBounds, scale[axis])];
+			grow(bin.bounds, prim.bounds);
+			bin.count++;
+		}
+	}
+}
+
+/*
+recursively build a node by binning the prim centroids and evaluating the SAH
+at the bin boundaries; big nodes build their children as separate tasks
+	state: build state
+	nodeIndex: node to fill in (already allocated)
+	begin, end: range of prims under this node
+	depth: depth of this node
+*/
+static void buildBinned(BuildState &state, int nodeIndex, int begin, int end, int depth) {
+	int n = end - begin;
+	AABB bounds, centroidBounds;
+	Bin bins[3][BIN_COUNT];
+
+	for (int axis = 0; axis < 3; axis++) {
+		for (int b = 0; b < BIN_COUNT; b++) {
+			bins[axis][b].bounds = emptyBox();
+			bins[axis][b].count = 0;
+		}
+	}
+
+	// big nodes bound and bin their prims in parallel chunks
+	int chunks = n > PARALLEL_BIN_SIZE ? std::min(workerCount(), n / (PARALLEL_BIN_SIZE / 4)) : 1;
+	std::vector<AABB> chunkBounds(chunks), chunkCentroids(chunks);
+	std::vector<Bin> chunkBins(chunks * 3 * BIN_COUNT);
+
+	if (chunks > 1) {
+		TaskGroup group;
+		for (int c = 0; c < chunks; c++) {
+			runTask(group, [&state, &chunkBounds, &chunkCentroids, c, chunks, begin, n]() {
+				rangeBounds(state, begin + n * c / chunks, begin + n * (c + 1) / chunks, chunkBounds[c], chunkCentroids[c]);
+			});
+		}
+		waitTasks(group);
+
+		bounds = emptyBox();
+		centroidBounds = emptyBox();
+		for (int c = 0; c < chunks; c++) {
+			grow(bounds, chunkBounds[c]);
+			grow(centroidBounds, chunkCentroids[c]);
+		}
+	}
+	else {
+		rangeBounds(state, begin, end, bounds, centroidBounds);
+	}
+	(*state.nodes)[nodeIndex].bounds = bounds;
+
+	if (n == 1 || depth >= BVH_MAX_DEPTH) {
+		makeLeaf(state, nodeIndex, begin, end);
+		return;
+	}
+
+	glm::vec3 extent = centroidBounds.max - centroidBounds.min;
+	glm::vec3 scale;
+	for (int axis = 0; axis < 3; axis++) {
+		scale[axis] = extent[axis] > 0.0f ? BIN_COUNT / extent[axis] : 0.0f;
+	}
+
+	if (chunks > 1) {
+		TaskGroup group;
+		for (int c = 0; c < chunks; c++) {
+			Bin (*local)[BIN_COUNT] = reinterpret_cast<Bin (*)[BIN_COUNT]>(&chunkBins[c * 3 * BIN_COUNT]);
+			for (int b = 0; b < 3 * BIN_COUNT; b++) {
+				local[0][b].bounds = emptyBox();
+				local[0][b].count = 0;
+			}
+			runTask(group, [&state, &centroidBounds, &scale, local, c, chunks, begin, n]() {
+				binRange(state, begin + n * c / chunks, begin + n * (c + 1) / chunks, centroidBounds, scale, local);
+			});
+		}
+		waitTasks(group);
+
+		for (int c = 0; c < chunks; c++) {
+			for (int axis = 0; axis < 3; axis++) {
+				for (int b = 0; b < BIN_COUNT; b++) {
+					const Bin &local = chunkBins[(c * 3 + axis) * BIN_COUNT + b];
+					grow(bins[axis][b].bounds, local.bounds);
+					bins[axis][b].count += local.count;
+				}
+			}
+		}
+	}
+	else {
+		binRange(state, begin, end, centroidBounds, scale, bins);
+	}
+
+	// costs are compared scaled by the parent surface area
+	float parentArea = surfaceArea(bounds);
+	float bestCost = FLT_MAX;
+	int bestAxis = -1;
+	int bestSplit = 0;
+
+	for (int axis = 0; axis < 3; axis++) {
+		if (extent[axis] <= 0.0f) {
+			continue;
+		}
+
+		float rightArea[BIN_COUNT];
+		int rightCount[BIN_COUNT];
+		AABB right = emptyBox();
+		int count = 0;
+		for (int b = BIN_COUNT - 1; b > 0; b--) {
+			grow(right, bins[axis][b].bounds);
+			count += bins[axis][b].count;
+			rightArea[b] = surfaceArea(right);
+			rightCount[b] = count;
+		}
+
+		AABB left = emptyBox();
+		count = 0;
+		for (int b = 1; b < BIN_COUNT; b++) {
+			grow(left, bins[axis][b - 1].bounds);
+			count += bins[axis][b - 1].count;
+
+			if (count == 0 || rightCount[b] == 0) {
+				continue;
+			}
+
+			float cost = TRAVERSAL_COST * parentArea + surfaceArea(left) * leafCost(count) + rightArea[b] * leafCost(rightCount[b]);
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = b;
+			}
+		}
+	}
+
+	if (n <= MAX_LEAF_SIZE && (bestAxis < 0 || bestCost >= leafCost(n) * parentArea)) {
+		makeLeaf(state, nodeIndex, begin, end);
+		return;
+	}
+
+	int mid;
+	if (bestAxis < 0) {
+		// every centroid is in the same place, so any split is as good as another
+		mid = begin + n / 2;
+	}
+	else {
+		mid = int(std::partition(state.prims.begin() + begin, state.prims.begin() + end, [&](const BuildPrimitive &prim) {
+			return binIndex(prim.centroid, bestAxis, centroidBounds, scale[bestAxis]) < bestSplit;
+		}) - state.prims.begin());
+	}
+
+	int children = allocateChildren(state, nodeIndex);
+
+	if (n > PARALLEL_SUBTREE_SIZE) {
+		runTask(state.tasks, [&state, children, begin, mid, depth]() {
+			buildBinned(state, children, begin, mid, depth + 1);
+		});
+	}
+	else {
+		buildBinned(state, children, begin, mid, depth + 1);
+	}
+	buildBinned(state, children + 1, mid, end, depth + 1);
+}
+
+/*
+count the leaves and find the depth of a subtree
+	bvh: tree
+	nodeIndex: root of the subtree
+	depth: depth of the root
+	leaves: incremented for every leaf
+	maxDepth: output deepest leaf depth
+*/
+static void treeStats(const BVH &bvh, int nodeIndex, int depth, int &leaves, int &maxDepth) {
+	const BVHNode &node = bvh.nodes[nodeIndex];
+
+	if (node.count > 0) {
+		leaves++;
+		maxDepth = std::max(maxDepth, depth);
+		return;
+	}
+
+	treeStats(bvh, node.offset, depth + 1, leaves, maxDepth);
+	treeStats(bvh, node.offset + 1, depth + 1, leaves, maxDepth);
+}
+
+/*
+lay out each leaf's primitives as whole triangle blocks followed by its spheres and
+fill in the blocks (see BVH)
+	scene: compiled scene
+	bvh: tree with the binary nodes built
+*/
+static void packTriangleBlocks(const Scene &scene, BVH &bvh) {
+	int firstTriangle = int(scene.spheres.size() + scene.planes.size());
+	int firstInstance = firstTriangle + int(scene.triangles.size());
+	std::vector<int> packed;
+	packed.reserve(bvh.primitives.size() + bvh.primitives.size() / 2);
+
+	for (size_t n = 0; n < bvh.nodes.size(); n++) {
+		BVHNode &node = bvh.nodes[n];
+		if (node.count == 0) {
+			continue;
+		}
+
+		while (packed.size() % TRIANGLE_BLOCK_SIZE != 0) {
+			packed.push_back(-1);
+		}
+		int offset = int(packed.size());
+
+		for (int i = node.offset; i < node.offset + node.count; i++) {
+			if (bvh.primitives[i] >= firstTriangle && bvh.primitives[i] < firstInstance) {
+				packed.push_back(bvh.primitives[i]);
+			}
+		}
+		while (packed.size() % TRIANGLE_BLOCK_SIZE != 0) {
+			packed.push_back(-1);
+		}
+		for (int i = node.offset; i < node.offset + node.count; i++) {
+			if (bvh.primitives[i] < firstTriangle || bvh.primitives[i] >= firstInstance) {
+				packed.push_back(bvh.primitives[i]);
+			}
+		}
+
+		node.offset = offset;
+		node.count = int(packed.size()) - offset;
+	}
+
+	bvh.primitives.swap(packed);
+	bvh.blocks.assign((bvh.primitives.size() + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE, TriangleBlock());
+
+	for (size_t b = 0; b < bvh.blocks.size(); b++) {
+		TriangleBlock &block = bvh.blocks[b];
+
+		for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; lane++) {
+			size_t i = b * TRIANGLE_BLOCK_SIZE + lane;
+			int primitive = i < bvh.primitives.size() ? bvh.primitives[i] : -1;
+			Triangle triangle = {};
+
+			if (primitive >= firstTriangle && primitive < firstInstance) {
+				triangle = scene.triangles[primitive - firstTriangle];
+			}
+			else {
+				primitive = -1;
+			}
+
+			block.ax[lane] = triangle.a.x; block.ay[lane] = triangle.a.y; block.az[lane] = triangle.a.z;
+			block.e1x[lane] = triangle.e1.x; block.e1y[lane] = triangle.e1.y; block.e1z[lane] = triangle.e1.z;
+			block.e2x[lane] = triangle.e2.x; block.e2y[lane] = triangle.e2.y; block.e2z[lane] = triangle.e2.z;
+			block.primitive[lane] = primitive;
+		}
+	}
+}
+
+/*
+fill in a wide node from a binary node, pulling up grandchildren until the node is full
+	bvh: tree with the binary nodes built
+	wide: wide nodes being built
+	binaryIndex: binary node the wide node replaces
+	wideIndex: wide node to fill in (already allocated)
+*/
+template <int W>
+static void collapseNode(const BVH &bvh, MappedArray<WideBVHNode<W>> &wide, int binaryIndex, int wideIndex) {
+	int children[W];
+	int count = 0;
+
+	const BVHNode &root = bvh.nodes[binaryIndex];
+	if (root.count > 0) {
+		children[count++] = binaryIndex;
+	}
+	else {
+		children[count++] = root.offset;
+		children[count++] = root.offset + 1;
+	}
+
+	// open the interior child with the largest surface area until the node is full
+	while (count < W) {
+		int largest = -1;
+		float largestArea = -1.0f;
+
+		for (int i = 0; i < count; i++) {
+			const BVHNode &child = bvh.nodes[children[i]];
+			if (child.count == 0 && surfaceArea(child.bounds) > largestArea) {
+				largest = i;
+				largestArea = surfaceArea(child.bounds);
+			}
+		}
+
+		if (largest < 0) {
+			break;
+		}
+
+		int opened = bvh.nodes[children[largest]].offset;
+		children[largest] = opened;
+		children[count++] = opened + 1;
+	}
+
+	WideBVHNode<W> node;
+	node.occupied = (1 << count) - 1;
+	int interior[W];
+
+	for (int i = 0; i < W; i++) {
+		interior[i] = -1;
+
+		if (i >= count) {
+			node.minX[i] = node.minY[i] = node.minZ[i] = 0.0f;
+			node.maxX[i] = node.maxY[i] = node.maxZ[i] = 0.0f;
+			node.offset[i] = 0;
+			node.count[i] = 0;
+			continue;
+		}
+
+		const BVHNode &child = bvh.nodes[children[i]];
+		node.minX[i] = child.bounds.min.x; node.minY[i] = child.bounds.min.y; node.minZ[i] = child.bounds.min.z;
+		node.maxX[i] = child.bounds.max.x; node.maxY[i] = child.bounds.max.y; node.maxZ[i] = child.bounds.max.z;
+		node.count[i] = child.count;
+
+		if (child.count > 0) {
+			node.offset[i] = child.offset;
+		}
+		else {
+			node.offset[i] = int(wide.size());
+			interior[i] = node.offset[i];
+			wide.push_back(WideBVHNode<W>());
+		}
+	}
+
+	wide[wideIndex] = node;
+
+	for (int i = 0; i < count; i++) {
+		if (interior[i] >= 0) {
+			collapseNode(bvh, wide, children[i], interior[i]);
+		}
+	}
+}
+
+/*
+collapse the tree of every instanced mesh after the scene's wide tree
+	bvh: tree with the binary nodes built
+	wide: wide nodes being built
+	root: member of BVHRoot that records where each mesh's wide tree starts
+*/
+template <int W>
+static void collapseMeshTrees(BVH &bvh, MappedArray<WideBVHNode<W>> &wide, int BVHRoot::*root) {
+	for (size_t m = 0; m < bvh.meshRoots.size(); m++) {
+		BVHRoot &meshRoot = bvh.meshRoots[m];
+		if (meshRoot.node < 0)
+			continue;
+
+		meshRoot.*root = int(wide.size());
+		wide.push_back(WideBVHNode<W>());
+		collapseNode(bvh, wide, meshRoot.node, meshRoot.*root);
+	}
+}
+
+/*
+collapse the binary tree of a BVH into a 4 or 8 wide one (anything else clears the wide trees)
+	bvh: tree with the binary nodes built
+	width: branching factor
+*/
+void buildWideBVH(BVH &bvh, int width) {
+	bvh.nodes4.clear();
+	bvh.nodes8.clear();
+
+	if (bvh.nodes.empty()) {
+		return;
+	}
+
+	for (size_t m = 0; m < bvh.meshRoots.size(); m++) {
+		bvh.meshRoots[m].node4 = -1;
+		bvh.meshRoots[m].node8 = -1;
+	}
+
+	if (width == 4) {
+		bvh.nodes4.push_back(WideBVHNode<4>());
+		collapseNode(bvh, bvh.nodes4, 0, 0);
+		collapseMeshTrees(bvh, bvh.nodes4, &BVHRoot::node4);
+		std::cout << "Collapsed BVH to " << bvh.nodes4.size() << " 4-wide nodes\n";
+	}
+	else if (width == 8) {
+		bvh.nodes8.push_back(WideBVHNode<8>());
+		collapseNode(bvh, bvh.nodes8, 0, 0);
+		collapseMeshTrees(bvh, bvh.nodes8, &BVHRoot::node8);
+		std::cout << "Collapsed BVH to " << bvh.nodes8.size() << " 8-wide nodes\n";
+	}
+}
+
+/*
+build a binary tree over a list of prims and lay out its leaves in triangle blocks
+	scene: compiled scene
+	prims: primitives to build over, used up by the build
+	tree: output tree, without wide nodes
+*/
+static void buildTree(const Scene &scene, std::vector<BuildPrimitive> &prims, BVH &tree) {
+	BuildState state;
+	state.prims.swap(prims);
+
+	int n = int(state.prims.size());
+	if (n == 0) {
+		return;
+	}
+
+	// a binary tree with at least one primitive per leaf never needs more than 2n - 1 nodes
+	tree.nodes.resize(2 * n);
+	state.nodes = &tree.nodes;
+	state.nodeCount = 1;
+
+	if (bvhBuilder == SWEEP_SAH_BUILDER) {
+		buildSweep(state, 0, 0, n, 0);
+	}
+	else {
+		buildBinned(state, 0, 0, n, 0);
+		waitTasks(state.tasks);
+	}
+
+	tree.nodes.resize(state.nodeCount);
+	tree.primitives.resize(n);
+	for (int i = 0; i < n; i++) {
+		tree.primitives[i] = state.prims[i].id;
+	}
+
+	packTriangleBlocks(scene, tree);
+}
+
+/*
+append the tree of a mesh to the arrays of a BVH, moving its offsets to where it lands
+	bvh: BVH being built
+	tree: tree of a mesh, without wide nodes
+	returns the index of the tree's root in bvh.nodes
+*/
+static int appendTree(BVH &bvh, const BVH &tree) {
+	// the tree's primitives must start a block so its blocks line up with them
+	while (bvh.primitives.size() % TRIANGLE_BLOCK_SIZE != 0) {
+		bvh.primitives.push_back(-1);
+	}
+	bvh.blocks.resize(bvh.primitives.size() / TRIANGLE_BLOCK_SIZE);
+
+	int nodeOffset = int(bvh.nodes.size());
+	int primitiveOffset = int(bvh.primitives.size());
+
+	for (size_t i = 0; i < tree.nodes.size(); i++) {
+		BVHNode node = tree.nodes[i];
+		node.offset += node.count > 0 ? primitiveOffset : nodeOffset;
+		bvh.nodes.push_back(node);
+	}
+	for (size_t i = 0; i < tree.primitives.size(); i++) {
+		bvh.primitives.push_back(tree.primitives[i]);
+	}
+	for (size_t i = 0; i < tree.blocks.size(); i++) {
+		bvh.blocks.push_back(tree.blocks[i]);
+	}
+
+	return nodeOffset;
+}
+
+/*
+build a SAH bounding volume hierarchy over the spheres, triangles and instances of a scene,
+and one over the triangles of each instanced mesh
+	scene: compiled scene
+	bvh: output tree
+*/
+void buildBVH(const Scene &scene, BVH &bvh) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	bvh.nodes.clear();
+	bvh.primitives.clear();
+	bvh.blocks.clear();
+	bvh.nodes4.clear();
+	bvh.nodes8.clear();
+	bvh.meshRoots.clear();
+
+	int spheres = int(scene.spheres.size());
+	int planes = int(scene.planes.size());
+	int triangles = int(scene.triangles.size());
+	int instances = int(scene.instances.size());
+	int firstTriangle = spheres + planes;
+
+	// the meshes' own trees come first, as instances are bounded by them
+	std::vector<bool> instanced(scene.meshes.size(), false);
+	for (int i = 0; i < instances; i++) {
+		instanced[scene.instances[i].mesh] = true;
+	}
+
+	std::vector<BVH> meshTrees(scene.meshes.size());
+	int meshTreeCount = 0, meshTriangles = 0;
+	for (size_t m = 0; m < scene.meshes.size(); m++) {
+		const Mesh &mesh = scene.meshes[m];
+		if (!instanced[m])
+			continue;
+
+		std::vector<BuildPrimitive> prims(mesh.triangleCount);
+		for (int i = 0; i < mesh.triangleCount; i++) {
+			prims[i].id = firstTriangle + mesh.firstTriangle + i;
+			prims[i].bounds = primitiveBounds(scene, prims[i].id);
+			prims[i].centroid = (prims[i].bounds.min + prims[i].bounds.max) * 0.5f;
+		}
+		buildTree(scene, prims, meshTrees[m]);
+
+		if (!meshTrees[m].nodes.empty()) {
+			meshTreeCount++;
+			meshTriangles += mesh.triangleCount;
+		}
+	}
+
+	// triangles of named meshes are only drawn through instances
+	std::vector<bool> prototype(triangles, false);
+	for (size_t m = 0; m < scene.meshes.size(); m++) {
+		const Mesh &mesh = scene.meshes[m];
+		if (mesh.prototype) {
+			std::fill(prototype.begin() + mesh.firstTriangle, prototype.begin() + mesh.firstTriangle + mesh.triangleCount, true);
+		}
+	}
+
+	std::vector<BuildPrimitive> prims;
+	prims.reserve(spheres + triangles + instances);
+	for (int i = 0; i < firstTriangle + triangles + instances; i++) {
+		if (i >= spheres && i < firstTriangle) {
+			continue;
+		}
+		if (i >= firstTriangle && i < firstTriangle + triangles && prototype[i - firstTriangle]) {
+			continue;
+		}
+
+		BuildPrimitive prim;
+		prim.id = i;
+		if (i >= firstTriangle + triangles) {
+			const Instance &instance = scene.instances[i - firstTriangle - triangles];
+			const BVH &meshTree = meshTrees[instance.mesh];
+			if (meshTree.nodes.empty())
+				continue;
+
+			prim.bounds = instanceBounds(instance, meshTree.nodes[0].bounds);
+		}
+		else {
+			prim.bounds = primitiveBounds(scene, i);
+		}
+		prim.centroid = (prim.bounds.min + prim.bounds.max) * 0.5f;
+		prims.push_back(prim);
+	}
+
+	int n = int(prims.size());
+	buildTree(scene, prims, bvh);
+	if (n == 0) {
+		return;
+	}
+
+	BVHRoot noRoot = { -1, -1, -1 };
+	bvh.meshRoots.assign(scene.meshes.size(), noRoot);
+	for (size_t m = 0; m < scene.meshes.size(); m++) {
+		if (!meshTrees[m].nodes.empty()) {
+			bvh.meshRoots[m].node = appendTree(bvh, meshTrees[m]);
+		}
+	}
+
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+	int leaves = 0, maxDepth = 0;
+	treeStats(bvh, 0, 0, leaves, maxDepth);
+
+	std::string builder = bvhBuilder == SWEEP_SAH_BUILDER ? "sweep SAH" : "binned SAH on " + std::to_string(workerCount()) + " threads";
+	std::cout << "Built BVH (" << builder << ") over " << n << " primitives: " << bvh.nodes.size() << " nodes, "
+		<< leaves << " leaves, depth " << maxDepth << ", " << bvh.blocks.size() << " triangle blocks in " << elapsed.count() << " ms\n";
+	if (meshTreeCount > 0) {
+		std::cout << "Including " << meshTreeCount << " mesh BVHs over " << meshTriangles << " triangles for " << instances << " instances\n";
+	}
+
+	buildWideBVH(bvh, bvhWidth);
+}
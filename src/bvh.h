@@ -0,0 +1,328 @@
+#pragma once
+
+// Bounding volume hierarchy over the bounded primitives (spheres, triangles and instances)
+// of the compiled scene. Planes are unbounded and are intersected separately.
+
+#include <glm/glm.hpp>
+
+#include <memory>
+#include <vector>
+
+#include "mapped.h"
+
+// SSE is used for 4-wide node tests and AVX for 8-wide ones when the compiler targets them
+// (x64 always has SSE2, build with /arch:AVX2 or -mavx2 to get the AVX path)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BVH_SSE
+#include <emmintrin.h>
+#endif
+#if defined(__AVX__)
+#define BVH_AVX
+#include <immintrin.h>
+#endif
+
+struct Scene;
+
+struct AABB {
+	glm::vec3 min;
+	glm::vec3 max;
+};
+
+// Interior nodes have count == 0 and their two children stored next to each other
+// at offset and offset + 1. Leaves reference count primitive ids starting at offset.
+struct BVHNode {
+	AABB bounds;
+	int offset;
+	int count;
+};
+
+// A node of a W-wide BVH with its children's bounds stored per axis so one ray can be
+// tested against all of them at once. Leaves (count > 0) reference primitive ids like
+// binary leaves, interior children (count == 0) reference another wide node.
+template <int W>
+struct WideBVHNode {
+	float minX[W], minY[W], minZ[W];
+	float maxX[W], maxY[W], maxZ[W];
+	int offset[W];
+	int count[W];
+	int occupied; // bit i is set if slot i holds a child
+};
+
+// Triangles are intersected a block at a time, 8 per block with AVX and 4 otherwise.
+#ifdef BVH_AVX
+const int TRIANGLE_BLOCK_SIZE = 8;
+#else
+const int TRIANGLE_BLOCK_SIZE = 4;
+#endif
+
+// The corner and edges of TRIANGLE_BLOCK_SIZE triangles stored per component so one
+// ray can be tested against all of them at once. Unused lanes have primitive -1 and
+// zero edges, which can never be hit.
+struct TriangleBlock {
+	float ax[TRIANGLE_BLOCK_SIZE], ay[TRIANGLE_BLOCK_SIZE], az[TRIANGLE_BLOCK_SIZE];
+	float e1x[TRIANGLE_BLOCK_SIZE], e1y[TRIANGLE_BLOCK_SIZE], e1z[TRIANGLE_BLOCK_SIZE];
+	float e2x[TRIANGLE_BLOCK_SIZE], e2y[TRIANGLE_BLOCK_SIZE], e2z[TRIANGLE_BLOCK_SIZE];
+	int primitive[TRIANGLE_BLOCK_SIZE];
+};
+
+// Where the tree of an instanced mesh starts in each node array, -1 for meshes without
+// instances and for wide trees that were not built.
+struct BVHRoot {
+	int node;
+	int node4;
+	int node8;
+};
+
+// Each leaf's primitive range starts on a multiple of TRIANGLE_BLOCK_SIZE and holds its
+// triangles first, padded with -1 to a whole number of blocks, then its spheres. The
+// triangles at primitives[i] belong to blocks[i / TRIANGLE_BLOCK_SIZE].
+// The scene's tree is rooted at node 0 of every array. Each instanced mesh has its own tree
+// over its triangles stored after it in the same arrays, and an instance is a leaf primitive
+// of the scene's tree whose rays continue into its mesh's tree.
+// The arrays are built by buildBVH, or are views of a mapped cache file (see bvhcache.h),
+// which file then keeps mapped.
+struct BVH {
+	MappedArray<BVHNode> nodes;
+	MappedArray<int> primitives; // primitive ids in leaf order, -1 for padding
+	MappedArray<TriangleBlock> blocks;
+
+	// the binary tree collapsed into a wide one when bvhWidth is 4 or 8
+	MappedArray<WideBVHNode<4>> nodes4;
+	MappedArray<WideBVHNode<8>> nodes8;
+
+	MappedArray<BVHRoot> meshRoots; // one per mesh of the scene
+
+	std::shared_ptr<MappedFile> file;
+};
+
+enum BVHBuilder {
+	SWEEP_SAH_BUILDER,  // exact SAH over every split, single threaded
+	BINNED_SAH_BUILDER  // SAH over binned split candidates, built on the task pool
+};
+
+extern BVHBuilder bvhBuilder;
+
+// branching factor traversed by intersect(): 2 (binary), 4 or 8
+extern int bvhWidth;
+
+// intersect leaf triangles a block at a time rather than one by one
+extern bool useTriangleBlocks;
+
+// deep enough for any tree the builder produces, used to size traversal stacks
+const int BVH_MAX_DEPTH = 60;
+
+AABB primitiveBounds(const Scene &scene, int primitive);
+void buildBVH(const Scene &scene, BVH &bvh);
+void buildWideBVH(BVH &bvh, int width);
+
+/*
+ray box slab test
+	e: origin of ray
+	invD: 1 / (s - e), per component
+	box: box to test
+	tMax: only count intersections closer than this
+	tNear: output t value where the ray enters the box
+*/
+inline bool rayBoxIntersection(const glm::vec3 &e, const glm::vec3 &invD, const AABB &box, float tMax, float &tNear) {
+	glm::vec3 t0 = (box.min - e) * invD;
+	glm::vec3 t1 = (box.max - e) * invD;
+	glm::vec3 tSmall = glm::min(t0, t1);
+	glm::vec3 tBig = glm::max(t0, t1);
+
+	tNear = glm::max(glm::max(tSmall.x, tSmall.y), glm::max(tSmall.z, 0.0f));
+	float tFar = glm::min(glm::min(tBig.x, tBig.y), glm::min(tBig.z, tMax));
+
+	return tNear <= tFar;
+}
+
+/*
+test a ray against four boxes stored per axis
+	minX ... maxZ: bounds of the four boxes, one array per axis
+	e: origin of ray
+	invD: 1 / (s - e), per component
+	tMax: only count intersections closer than this
+	tNear: output t values where the ray enters each box
+	returns a bit mask of the boxes that were hit
+*/
+inline int rayBoxIntersection4(const float *minX, const float *minY, const float *minZ, const float *maxX, const float *maxY, const float *maxZ,
+	const glm::vec3 &e, const glm::vec3 &invD, float tMax, float tNear[4]) {
+#ifdef BVH_SSE
+	__m128 ex = _mm_set1_ps(e.x), ey = _mm_set1_ps(e.y), ez = _mm_set1_ps(e.z);
+	__m128 ix = _mm_set1_ps(invD.x), iy = _mm_set1_ps(invD.y), iz = _mm_set1_ps(invD.z);
+
+	__m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(minX), ex), ix);
+	__m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(maxX), ex), ix);
+	__m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(minY), ey), iy);
+	__m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(maxY), ey), iy);
+	__m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(minZ), ez), iz);
+	__m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(maxZ), ez), iz);
+
+	__m128 near = _mm_max_ps(_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)), _mm_max_ps(_mm_min_ps(t0z, t1z), _mm_setzero_ps()));
+	__m128 far = _mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)), _mm_min_ps(_mm_max_ps(t0z, t1z), _mm_set1_ps(tMax)));
+
+	_mm_storeu_ps(tNear, near);
+	return _mm_movemask_ps(_mm_cmple_ps(near, far));
+#else
+	int mask = 0;
+	for (int i = 0; i < 4; i++) {
+		AABB box = { glm::vec3(minX[i], minY[i], minZ[i]), glm::vec3(maxX[i], maxY[i], maxZ[i]) };
+		if (rayBoxIntersection(e, invD, box, tMax, tNear[i])) {
+			mask |= 1 << i;
+		}
+	}
+	return mask;
+#endif
+}
+
+/*
+test a ray against all the children of a 4-wide node, returns a bit mask of the children that were hit
+*/
+inline int rayWideBoxIntersection(const WideBVHNode<4> &node, const glm::vec3 &e, const glm::vec3 &invD, float tMax, float tNear[4]) {
+	return rayBoxIntersection4(node.minX, node.minY, node.minZ, node.maxX, node.maxY, node.maxZ, e, invD, tMax, tNear) & node.occupied;
+}
+
+/*
+test a ray against all the children of an 8-wide node, returns a bit mask of the children that were hit
+*/
+inline int rayWideBoxIntersection(const WideBVHNode<8> &node, const glm::vec3 &e, const glm::vec3 &invD, float tMax, float tNear[8]) {
+#ifdef BVH_AVX
+	__m256 ex = _mm256_set1_ps(e.x), ey = _mm256_set1_ps(e.y), ez = _mm256_set1_ps(e.z);
+	__m256 ix = _mm256_set1_ps(invD.x), iy = _mm256_set1_ps(invD.y), iz = _mm256_set1_ps(invD.z);
+
+	__m256 t0x = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.minX), ex), ix);
+	__m256 t1x = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.maxX), ex), ix);
+	__m256 t0y = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.minY), ey), iy);
+	__m256 t1y = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.maxY), ey), iy);
+	__m256 t0z = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.minZ), ez), iz);
+	__m256 t1z = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.maxZ), ez), iz);
+
+	__m256 near = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(t0x, t1x), _mm256_min_ps(t0y, t1y)), _mm256_max_ps(_mm256_min_ps(t0z, t1z), _mm256_setzero_ps()));
+	__m256 far = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(t0x, t1x), _mm256_max_ps(t0y, t1y)), _mm256_min_ps(_mm256_max_ps(t0z, t1z), _mm256_set1_ps(tMax)));
+
+	_mm256_storeu_ps(tNear, near);
+	return _mm256_movemask_ps(_mm256_cmp_ps(near, far, _CMP_LE_OQ)) & node.occupied;
+#else
+	// without AVX the node is tested as two 4-wide halves
+	int low = rayBoxIntersection4(node.minX, node.minY, node.minZ, node.maxX, node.maxY, node.maxZ, e, invD, tMax, tNear);
+	int high = rayBoxIntersection4(node.minX + 4, node.minY + 4, node.minZ + 4, node.maxX + 4, node.maxY + 4, node.maxZ + 4, e, invD, tMax, tNear + 4);
+	return (low | (high << 4)) & node.occupied;
+#endif
+}
+
+/*
+intersect a ray with every triangle of a block (Moller-Trumbore in each lane)
+	block: triangle block
+	e: origin of ray
+	d: direction of ray (s - e)
+	tMin: only count intersections farther than this
+	tMax: only count intersections closer than this
+	t: output t value of the closest intersection in the block
+	lane: output lane of the closest intersection in the block
+	returns false if no triangle in the block was hit
+*/
+inline bool rayTriangleBlockIntersection(const TriangleBlock &block, const glm::vec3 &e, const glm::vec3 &d, float tMin, float tMax, float &t, int &lane) {
+	float laneT[TRIANGLE_BLOCK_SIZE];
+	int mask;
+
+#if defined(BVH_AVX)
+	__m256 dx = _mm256_set1_ps(d.x), dy = _mm256_set1_ps(d.y), dz = _mm256_set1_ps(d.z);
+	__m256 e1x = _mm256_loadu_ps(block.e1x), e1y = _mm256_loadu_ps(block.e1y), e1z = _mm256_loadu_ps(block.e1z);
+	__m256 e2x = _mm256_loadu_ps(block.e2x), e2y = _mm256_loadu_ps(block.e2y), e2z = _mm256_loadu_ps(block.e2z);
+
+	// p = d x e2, determinant = e1 . p
+	__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+	__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+	__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+	__m256 determinant = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+	__m256 inverse = _mm256_div_ps(_mm256_set1_ps(1.0f), determinant);
+
+	// o = e - a, u = (o . p) / determinant
+	__m256 ox = _mm256_sub_ps(_mm256_set1_ps(e.x), _mm256_loadu_ps(block.ax));
+	__m256 oy = _mm256_sub_ps(_mm256_set1_ps(e.y), _mm256_loadu_ps(block.ay));
+	__m256 oz = _mm256_sub_ps(_mm256_set1_ps(e.z), _mm256_loadu_ps(block.az));
+	__m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ox, px), _mm256_mul_ps(oy, py)), _mm256_mul_ps(oz, pz)), inverse);
+
+	// q = o x e1, v = (d . q) / determinant, t = (e2 . q) / determinant
+	__m256 qx = _mm256_sub_ps(_mm256_mul_ps(oy, e1z), _mm256_mul_ps(oz, e1y));
+	__m256 qy = _mm256_sub_ps(_mm256_mul_ps(oz, e1x), _mm256_mul_ps(ox, e1z));
+	__m256 qz = _mm256_sub_ps(_mm256_mul_ps(ox, e1y), _mm256_mul_ps(oy, e1x));
+	__m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inverse);
+	__m256 hitT = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), inverse);
+
+	__m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+	__m256 inside = _mm256_and_ps(_mm256_cmp_ps(determinant, zero, _CMP_NEQ_OQ), _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+	inside = _mm256_and_ps(inside, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+	inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+	inside = _mm256_and_ps(inside, _mm256_cmp_ps(hitT, _mm256_set1_ps(tMin), _CMP_GT_OQ));
+	inside = _mm256_and_ps(inside, _mm256_cmp_ps(hitT, _mm256_set1_ps(tMax), _CMP_LT_OQ));
+
+	mask = _mm256_movemask_ps(inside);
+	_mm256_storeu_ps(laneT, hitT);
+#elif defined(BVH_SSE)
+	__m128 dx = _mm_set1_ps(d.x), dy = _mm_set1_ps(d.y), dz = _mm_set1_ps(d.z);
+	__m128 e1x = _mm_loadu_ps(block.e1x), e1y = _mm_loadu_ps(block.e1y), e1z = _mm_loadu_ps(block.e1z);
+	__m128 e2x = _mm_loadu_ps(block.e2x), e2y = _mm_loadu_ps(block.e2y), e2z = _mm_loadu_ps(block.e2z);
+
+	// p = d x e2, determinant = e1 . p
+	__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+	__m128 determinant = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	__m128 inverse = _mm_div_ps(_mm_set1_ps(1.0f), determinant);
+
+	// o = e - a, u = (o . p) / determinant
+	__m128 ox = _mm_sub_ps(_mm_set1_ps(e.x), _mm_loadu_ps(block.ax));
+	__m128 oy = _mm_sub_ps(_mm_set1_ps(e.y), _mm_loadu_ps(block.ay));
+	__m128 oz = _mm_sub_ps(_mm_set1_ps(e.z), _mm_loadu_ps(block.az));
+	__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, px), _mm_mul_ps(oy, py)), _mm_mul_ps(oz, pz)), inverse);
+
+	// q = o x e1, v = (d . q) / determinant, t = (e2 . q) / determinant
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(oy, e1z), _mm_mul_ps(oz, e1y));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(oz, e1x), _mm_mul_ps(ox, e1z));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(ox, e1y), _mm_mul_ps(oy, e1x));
+	__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inverse);
+	__m128 hitT = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inverse);
+
+	__m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+	__m128 inside = _mm_and_ps(_mm_cmpneq_ps(determinant, zero), _mm_cmpge_ps(u, zero));
+	inside = _mm_and_ps(inside, _mm_cmpge_ps(v, zero));
+	inside = _mm_and_ps(inside, _mm_cmple_ps(_mm_add_ps(u, v), one));
+	inside = _mm_and_ps(inside, _mm_cmpgt_ps(hitT, _mm_set1_ps(tMin)));
+	inside = _mm_and_ps(inside, _mm_cmplt_ps(hitT, _mm_set1_ps(tMax)));
+
+	mask = _mm_movemask_ps(inside);
+	_mm_storeu_ps(laneT, hitT);
+#else
+	mask = 0;
+	for (int i = 0; i < TRIANGLE_BLOCK_SIZE; i++) {
+		glm::vec3 e1(block.e1x[i], block.e1y[i], block.e1z[i]);
+		glm::vec3 e2(block.e2x[i], block.e2y[i], block.e2z[i]);
+		glm::vec3 p = glm::cross(d, e2);
+		float determinant = glm::dot(e1, p);
+		if (determinant == 0)
+			continue;
+
+		glm::vec3 o = e - glm::vec3(block.ax[i], block.ay[i], block.az[i]);
+		glm::vec3 q = glm::cross(o, e1);
+		float u = glm::dot(o, p) / determinant;
+		float v = glm::dot(d, q) / determinant;
+		laneT[i] = glm::dot(e2, q) / determinant;
+
+		if (u >= 0 && v >= 0 && u + v <= 1 && laneT[i] > tMin && laneT[i] < tMax) {
+			mask |= 1 << i;
+		}
+	}
+#endif
+
+	if (mask == 0)
+		return false;
+
+	lane = -1;
+	for (int i = 0; i < TRIANGLE_BLOCK_SIZE; i++) {
+		if ((mask & (1 << i)) && (lane < 0 || laneT[i] < t)) {
+			lane = i;
+			t = laneT[i];
+		}
+	}
+	return true;
+}
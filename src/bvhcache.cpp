@@ -0,0 +1,342 @@
+/*
+	BVH cache
+	The key covers everything the tree is built from: the positions of the spheres
+	and triangles, the meshes and the placement of their instances, the primitive
+	numbering, and the builder, width and leaf packing options. Materials and lights can change without invalidating a cached tree.
+	Several processes may build the same tree at once, so files are written under a
+	temporary name and renamed into place, and readers never see half a file.
+*/
+
+#include "bvhcache.h"
+#include "scene.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+bool useBVHCache = true;
+
+static uint64_t mix(uint64_t h) {
+	h *= 0x9e3779b97f4a7c15ull;
+	return h ^ (h >> 29);
+}
+
+// hash bytes 8 at a time into a running hash
+static void hashBytes(uint64_t &h, const void *data, size_t size) {
+	const unsigned char *bytes = (const unsigned char *)data;
+	for (; size >= 8; size -= 8, bytes += 8) {
+		uint64_t word;
+		memcpy(&word, bytes, 8);
+		h = mix(h ^ word);
+	}
+	if (size > 0) {
+		uint64_t word = 0;
+		memcpy(&word, bytes, size);
+		h = mix(h ^ word ^ (uint64_t(size) << 56));
+	}
+}
+
+/*
+hash the parts of a scene and the settings that a BVH built for it depends on
+	scene: compiled scene
+	returns the key for cache files of the scene
+*/
+uint64_t bvhCacheKey(const Scene &scene) {
+	uint64_t h = 0xcbf29ce484222325ull;
+
+	uint64_t settings[] = { BVH_CACHE_VERSION, uint64_t(bvhBuilder), uint64_t(bvhWidth), uint64_t(useTriangleBlocks), uint64_t(TRIANGLE_BLOCK_SIZE),
+		scene.spheres.size(), scene.planes.size(), scene.triangles.size(), scene.meshes.size(), scene.instances.size() };
+	hashBytes(h, settings, sizeof(settings));
+
+	for (const Sphere &sphere : scene.spheres) {
+		float position[4] = { sphere.c.x, sphere.c.y, sphere.c.z, sphere.R };
+		hashBytes(h, position, sizeof(position));
+	}
+	for (const Triangle &triangle : scene.triangles) {
+		float position[9] = { triangle.a.x, triangle.a.y, triangle.a.z, triangle.e1.x, triangle.e1.y, triangle.e1.z, triangle.e2.x, triangle.e2.y, triangle.e2.z };
+		hashBytes(h, position, sizeof(position));
+	}
+	for (const Mesh &mesh : scene.meshes) {
+		int range[3] = { mesh.firstTriangle, mesh.triangleCount, mesh.prototype };
+		hashBytes(h, range, sizeof(range));
+	}
+	for (const Instance &instance : scene.instances) {
+		hashBytes(h, &instance.toWorld, sizeof(instance.toWorld));
+		hashBytes(h, &instance.toWorldOffset, sizeof(instance.toWorldOffset));
+		hashBytes(h, &instance.mesh, sizeof(instance.mesh));
+	}
+
+	// spread the last words into every bit
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	return h;
+}
+
+/*
+name of the cache file for a scene
+	scenePath: the scene's file, the cache file is put next to it
+	key: bvhCacheKey of the scene
+*/
+std::string bvhCachePath(const std::string &scenePath, uint64_t key) {
+	std::string base = scenePath.substr(0, scenePath.rfind('.'));
+	std::ostringstream name;
+	name << base << "." << std::hex << std::setw(16) << std::setfill('0') << key << ".bvh";
+	return name.str();
+}
+
+// a leaf's range must lie in the primitive list
+static bool validLeaf(const BVH &bvh, int offset, int count) {
+	return offset >= 0 && count > 0 && size_t(offset) <= bvh.primitives.size() && size_t(count) <= bvh.primitives.size() - offset;
+}
+
+/*
+check that a binary tree read from a file can be traversed: every child and leaf range is
+in its array, and the tree is no deeper than the traversal stacks allow
+	bvh: tree whose arrays were read
+	root: node the tree starts at
+	visits: nodes that may still be visited, a tree visits each node at most once
+	returns false if the tree would be traversed out of bounds
+*/
+static bool validTree(const BVH &bvh, int root, size_t &visits) {
+	if (root < 0 || size_t(root) >= bvh.nodes.size())
+		return false;
+
+	// nodes to check, with their depth
+	std::vector<std::pair<int, int>> pending(1, std::make_pair(root, 0));
+	while (!pending.empty()) {
+		const BVHNode &node = bvh.nodes[pending.back().first];
+		int depth = pending.back().second;
+		pending.pop_back();
+
+		if (visits == 0)
+			return false;
+		visits--;
+
+		if (node.count > 0) {
+			if (!validLeaf(bvh, node.offset, node.count))
+				return false;
+			continue;
+		}
+
+		if (node.count < 0 || depth >= BVH_MAX_DEPTH || node.offset < 0 || size_t(node.offset) + 1 >= bvh.nodes.size())
+			return false;
+		pending.push_back(std::make_pair(node.offset, depth + 1));
+		pending.push_back(std::make_pair(node.offset + 1, depth + 1));
+	}
+	return true;
+}
+
+/*
+check that a wide tree read from a file can be traversed, as validTree does for binary trees
+	nodes: 4 or 8 wide nodes
+	(other parameters as for validTree)
+*/
+template <int W>
+static bool validWideTree(const BVH &bvh, const MappedArray<WideBVHNode<W>> &nodes, int root, size_t &visits) {
+	if (root < 0 || size_t(root) >= nodes.size())
+		return false;
+
+	std::vector<std::pair<int, int>> pending(1, std::make_pair(root, 0));
+	while (!pending.empty()) {
+		const WideBVHNode<W> &node = nodes[pending.back().first];
+		int depth = pending.back().second;
+		pending.pop_back();
+
+		if (visits == 0)
+			return false;
+		visits--;
+
+		for (int i = 0; i < W; i++) {
+			if (!(node.occupied & (1 << i)))
+				continue;
+
+			if (node.count[i] > 0) {
+				if (!validLeaf(bvh, node.offset[i], node.count[i]))
+					return false;
+				continue;
+			}
+
+			if (node.count[i] < 0 || depth >= BVH_MAX_DEPTH || node.offset[i] < 0 || size_t(node.offset[i]) >= nodes.size())
+				return false;
+			pending.push_back(std::make_pair(node.offset[i], depth + 1));
+		}
+	}
+	return true;
+}
+
+/*
+check that a BVH read from a file only refers to nodes, primitives and blocks that exist,
+so a damaged file is rejected rather than traversed out of bounds
+	scene: compiled scene the tree is for
+	bvh: tree whose arrays were read
+	returns false if the tree cannot be used
+*/
+static bool validBVH(const Scene &scene, const BVH &bvh) {
+	int firstTriangle = int(scene.spheres.size() + scene.planes.size());
+	int firstInstance = firstTriangle + int(scene.triangles.size());
+	int primitiveCount = firstInstance + int(scene.instances.size());
+
+	for (size_t i = 0; i < bvh.primitives.size(); i++) {
+		if (bvh.primitives[i] < -1 || bvh.primitives[i] >= primitiveCount)
+			return false;
+	}
+
+	// leaves are read a block at a time, and a lane without a triangle must never be hit
+	if (useTriangleBlocks) {
+		if (bvh.blocks.size() < (bvh.primitives.size() + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE)
+			return false;
+
+		for (const TriangleBlock &block : bvh.blocks) {
+			for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; lane++) {
+				int primitive = block.primitive[lane];
+				bool empty = block.e1x[lane] == 0.0f && block.e1y[lane] == 0.0f && block.e1z[lane] == 0.0f
+					&& block.e2x[lane] == 0.0f && block.e2y[lane] == 0.0f && block.e2z[lane] == 0.0f;
+				if (primitive == -1 ? !empty : primitive < firstTriangle || primitive >= firstInstance)
+					return false;
+			}
+		}
+	}
+
+	// the scene's tree starts at node 0 of each array, and every instanced mesh has its own
+	if (bvh.meshRoots.size() != scene.meshes.size() || bvh.nodes.empty())
+		return false;
+
+	size_t visits = bvh.nodes.size(), visits4 = bvh.nodes4.size(), visits8 = bvh.nodes8.size();
+	if (!validTree(bvh, 0, visits) || (!bvh.nodes4.empty() && !validWideTree(bvh, bvh.nodes4, 0, visits4))
+		|| (!bvh.nodes8.empty() && !validWideTree(bvh, bvh.nodes8, 0, visits8)))
+		return false;
+
+	for (size_t m = 0; m < bvh.meshRoots.size(); m++) {
+		const BVHRoot &root = bvh.meshRoots[m];
+		if (root.node != -1 && !validTree(bvh, root.node, visits))
+			return false;
+		if (root.node4 != -1 && !validWideTree(bvh, bvh.nodes4, root.node4, visits4))
+			return false;
+		if (root.node8 != -1 && !validWideTree(bvh, bvh.nodes8, root.node8, visits8))
+			return false;
+	}
+
+	for (const Instance &instance : scene.instances) {
+		if (bvh.meshRoots[instance.mesh].node == -1)
+			return false;
+	}
+	return true;
+}
+
+/*
+map a BVH cache file and use its arrays in place
+	path: file to map
+	key: bvhCacheKey the tree must have been built for
+	scene: compiled scene the tree is for
+	bvh: output tree, which keeps the file mapped
+	error: output description of what was wrong with the file
+	returns false if the file could not be mapped, does not hold the tree for the key or holds a damaged tree
+*/
+bool mapBVHCache(const std::string &path, uint64_t key, const Scene &scene, BVH &bvh, std::string &error) {
+	std::shared_ptr<MappedFile> file = mapFile(path);
+	if (file == NULL) {
+		error = "unable to map the file";
+		return false;
+	}
+
+	BVHCacheHeader header;
+	if (file->size < sizeof(header)) {
+		error = "the file is too small";
+		return false;
+	}
+	memcpy(&header, file->data, sizeof(header));
+
+	if (memcmp(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic)) != 0) {
+		error = "not a BVH cache file";
+		return false;
+	}
+	if (header.version != BVH_CACHE_VERSION || header.byteOrder != FILE_BYTE_ORDER_MARK) {
+		error = "made by a different version or for a different machine";
+		return false;
+	}
+	if (header.key != key) {
+		error = "made for a different scene or different settings";
+		return false;
+	}
+
+	bvh = BVH();
+	bool valid = viewArray(*file, header.arrays[NODES_SECTION], bvh.nodes)
+		&& viewArray(*file, header.arrays[PRIMITIVES_SECTION], bvh.primitives)
+		&& viewArray(*file, header.arrays[BLOCKS_SECTION], bvh.blocks)
+		&& viewArray(*file, header.arrays[NODES4_SECTION], bvh.nodes4)
+		&& viewArray(*file, header.arrays[NODES8_SECTION], bvh.nodes8)
+		&& viewArray(*file, header.arrays[MESH_ROOTS_SECTION], bvh.meshRoots);
+	if (!valid) {
+		bvh = BVH();
+		error = "an array does not fit in the file or was written with a different layout";
+		return false;
+	}
+	if (!validBVH(scene, bvh)) {
+		bvh = BVH();
+		error = "the tree refers to nodes or primitives outside its arrays, or is too deep to traverse";
+		return false;
+	}
+	bvh.file = file;
+
+	std::cout << "Mapped BVH: " << bvh.nodes.size() << " nodes, " << bvh.blocks.size() << " triangle blocks\n";
+	return true;
+}
+
+/*
+write a built BVH as a cache file
+	path: file to write
+	key: bvhCacheKey the tree was built for
+	bvh: tree to write
+	returns false if the file could not be written
+*/
+bool writeBVHCache(const std::string &path, uint64_t key, const BVH &bvh) {
+	BVHCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic));
+	header.version = BVH_CACHE_VERSION;
+	header.byteOrder = FILE_BYTE_ORDER_MARK;
+	header.key = key;
+
+	uint64_t offset = sizeof(header);
+	placeArray(header.arrays[NODES_SECTION], bvh.nodes, offset);
+	placeArray(header.arrays[PRIMITIVES_SECTION], bvh.primitives, offset);
+	placeArray(header.arrays[BLOCKS_SECTION], bvh.blocks, offset);
+	placeArray(header.arrays[NODES4_SECTION], bvh.nodes4, offset);
+	placeArray(header.arrays[NODES8_SECTION], bvh.nodes8, offset);
+	placeArray(header.arrays[MESH_ROOTS_SECTION], bvh.meshRoots, offset);
+
+	std::ostringstream temporary;
+	temporary << path << "." << std::hex << std::random_device()() << ".tmp";
+	std::string temporaryPath = temporary.str();
+	{
+		std::ofstream out(temporaryPath, std::ios::binary);
+		if (!out.is_open())
+			return false;
+
+		out.write((const char *)&header, sizeof(header));
+		writeArray(out, header.arrays[NODES_SECTION], bvh.nodes);
+		writeArray(out, header.arrays[PRIMITIVES_SECTION], bvh.primitives);
+		writeArray(out, header.arrays[BLOCKS_SECTION], bvh.blocks);
+		writeArray(out, header.arrays[NODES4_SECTION], bvh.nodes4);
+		writeArray(out, header.arrays[NODES8_SECTION], bvh.nodes8);
+		writeArray(out, header.arrays[MESH_ROOTS_SECTION], bvh.meshRoots);
+
+		if (!out) {
+			out.close();
+			std::remove(temporaryPath.c_str());
+			return false;
+		}
+	}
+
+	// another process may have cached the same tree first, in which case its file is kept
+	if (std::rename(temporaryPath.c_str(), path.c_str()) != 0) {
+		std::remove(temporaryPath.c_str());
+	}
+	return true;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+// BVH cache files: a built BVH stored exactly as it is laid out in memory, named and checked
+// by a hash of the scene geometry and the builder settings, so later runs on the same scene
+// map the tree instead of building it again.
+
+#include "bvh.h"
+
+#include <cstdint>
+#include <string>
+
+struct Scene;
+
+const char BVH_CACHE_MAGIC[8] = { 'R', 'T', 'B', 'V', 'H', 0, 0, 0 };
+
+// raise whenever the header, the BVH structs or the way trees are built change
+const uint32_t BVH_CACHE_VERSION = 2;
+
+// scenes with fewer bounded primitives are quicker to build than to cache
+const int BVH_CACHE_MIN_PRIMITIVES = 10000;
+
+enum BVHCacheSection {
+	NODES_SECTION,
+	PRIMITIVES_SECTION,
+	BLOCKS_SECTION,
+	NODES4_SECTION,
+	NODES8_SECTION,
+	MESH_ROOTS_SECTION,
+	BVH_CACHE_SECTIONS
+};
+
+struct BVHCacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder; // FILE_BYTE_ORDER_MARK as written by the machine that made the file
+	uint64_t key; // bvhCacheKey of the scene and settings the tree was built for
+
+	FileArray arrays[BVH_CACHE_SECTIONS];
+};
+
+// look for and write cache files, on by default
+extern bool useBVHCache;
+
+uint64_t bvhCacheKey(const Scene &scene);
+std::string bvhCachePath(const std::string &scenePath, uint64_t key);
+bool mapBVHCache(const std::string &path, uint64_t key, const Scene &scene, BVH &bvh, std::string &error);
+bool writeBVHCache(const std::string &path, uint64_t key, const BVH &bvh);
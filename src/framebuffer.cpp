@@ -0,0 +1,162 @@
+/*
+	Framebuffer
+	Half floats keep 11 significant bits, far more than the 8 bits an image is
+	written with, and cover any colour a scene can reasonably produce.
+*/
+
+#include "framebuffer.h"
+
+#include <cstdint>
+#include <cstring>
+
+PixelFormat pixelFormat = PIXELS_FLOAT;
+
+// rows are padded to, and start on, multiples of this many bytes
+const size_t CACHE_LINE = 64;
+
+// round a float to the nearest half float
+static uint16_t floatToHalf(float value) {
+	uint32_t bits;
+	memcpy(&bits, &value, 4);
+
+	uint32_t sign = (bits >> 16) & 0x8000;
+	uint32_t magnitude = bits & 0x7fffffff;
+
+	// NaN stays NaN, anything too large for a half becomes infinity
+	if (magnitude > 0x7f800000)
+		return uint16_t(sign | 0x7e00);
+	if (magnitude >= 0x477ff000)
+		return uint16_t(sign | 0x7c00);
+
+	// too small to be a normal half: shift the significand (with its implicit bit) into a subnormal
+	if (magnitude < 0x38800000) {
+		if (magnitude < 0x33000000)
+			return uint16_t(sign);
+
+		int shift = 126 - int(magnitude >> 23);
+		uint32_t significand = (magnitude & 0x7fffff) | 0x800000;
+		uint32_t half = significand >> shift;
+		uint32_t rest = significand & ((1u << shift) - 1);
+		uint32_t halfway = 1u << (shift - 1);
+		if (rest > halfway || (rest == halfway && (half & 1))) {
+			half++;
+		}
+		return uint16_t(sign | half);
+	}
+
+	// rebias the exponent and round the significand to nearest, ties to even
+	uint32_t half = (magnitude - 0x38000000) >> 13;
+	uint32_t rest = magnitude & 0x1fff;
+	if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+		half++;
+	}
+	return uint16_t(sign | half);
+}
+
+static float halfToFloat(uint16_t half) {
+	uint32_t sign = uint32_t(half & 0x8000) << 16;
+	uint32_t exponent = (half >> 10) & 0x1f;
+	uint32_t significand = half & 0x3ff;
+	uint32_t bits;
+
+	if (exponent == 0x1f) {
+		bits = sign | 0x7f800000 | (significand << 13);
+	}
+	else if (exponent != 0) {
+		bits = sign | ((exponent + 112) << 23) | (significand << 13);
+	}
+	else if (significand == 0) {
+		bits = sign;
+	}
+	else {
+		// subnormal: normalise the significand
+		exponent = 113;
+		while ((significand & 0x400) == 0) {
+			significand <<= 1;
+			exponent--;
+		}
+		bits = sign | (exponent << 23) | ((significand & 0x3ff) << 13);
+	}
+
+	float value;
+	memcpy(&value, &bits, 4);
+	return value;
+}
+
+/*
+allocate a framebuffer for an image, keeping the old memory if it is large enough
+	framebuffer: framebuffer to resize, its pixels are undefined afterwards
+	width, height: size of the image in pixels
+	format: how the pixels are stored
+*/
+void resizeFramebuffer(Framebuffer &framebuffer, int width, int height, PixelFormat format) {
+	size_t pixelBytes = format == PIXELS_HALF ? 3 * sizeof(uint16_t) : sizeof(colour3);
+	size_t rowBytes = (size_t(width) * pixelBytes + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+	size_t bytes = rowBytes * height;
+	size_t oldBytes = framebuffer.rowBytes * framebuffer.height;
+
+	if (framebuffer.memory == NULL || bytes > oldBytes) {
+		framebuffer.memory.reset(new unsigned char[bytes + CACHE_LINE]);
+
+		size_t address = size_t(framebuffer.memory.get());
+		framebuffer.rows = framebuffer.memory.get() + (CACHE_LINE - address % CACHE_LINE) % CACHE_LINE;
+	}
+
+	framebuffer.width = width;
+	framebuffer.height = height;
+	framebuffer.format = format;
+	framebuffer.rowBytes = rowBytes;
+}
+
+/*
+set every pixel of a framebuffer to one colour
+	framebuffer: framebuffer to fill
+	colour: colour of every pixel
+*/
+void fillFramebuffer(Framebuffer &framebuffer, const colour3 &colour) {
+	for (int x = 0; x < framebuffer.width; x++) {
+		storePixel(framebuffer, x, 0, colour);
+	}
+
+	// the first row is a pattern for the others
+	for (int y = 1; y < framebuffer.height; y++) {
+		memcpy(framebuffer.rows + y * framebuffer.rowBytes, framebuffer.rows, framebuffer.rowBytes);
+	}
+}
+
+/*
+read a pixel
+	framebuffer: framebuffer to read
+	x, y: pixel, from the bottom left corner
+*/
+colour3 loadPixel(const Framebuffer &framebuffer, int x, int y) {
+	const unsigned char *row = framebuffer.rows + y * framebuffer.rowBytes;
+
+	if (framebuffer.format == PIXELS_HALF) {
+		uint16_t half[3];
+		memcpy(half, row + x * sizeof(half), sizeof(half));
+		return colour3(halfToFloat(half[0]), halfToFloat(half[1]), halfToFloat(half[2]));
+	}
+
+	colour3 colour;
+	memcpy(&colour, row + x * sizeof(colour3), sizeof(colour3));
+	return colour;
+}
+
+/*
+write a pixel
+	framebuffer: framebuffer to write
+	x, y: pixel, from the bottom left corner
+	colour: new colour of the pixel
+*/
+void storePixel(Framebuffer &framebuffer, int x, int y, const colour3 &colour) {
+	unsigned char *row = framebuffer.rows + y * framebuffer.rowBytes;
+
+	if (framebuffer.format == PIXELS_HALF) {
+		uint16_t half[3] = { floatToHalf(colour.r), floatToHalf(colour.g), floatToHalf(colour.b) };
+		memcpy(row + x * sizeof(half), half, sizeof(half));
+		return;
+	}
+
+	memcpy(row + x * sizeof(colour3), &colour, sizeof(colour3));
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+// An image held as linear RGB, either as 32 bit floats or as 16 bit half floats to halve
+// the memory of very large renders. Rows are padded to whole cache lines and the first
+// row starts on one, so every row starts on a cache line.
+
+#include "scene.h"
+
+#include <cstddef>
+#include <memory>
+
+enum PixelFormat { PIXELS_FLOAT, PIXELS_HALF };
+
+extern PixelFormat pixelFormat; // format of the images rendered from now on
+
+struct Framebuffer {
+	int width, height;
+	PixelFormat format;
+	size_t rowBytes; // distance between the starts of two rows
+	std::unique_ptr<unsigned char[]> memory;
+	unsigned char *rows; // row y (counted from the bottom of the image) starts at rows + y * rowBytes
+
+	Framebuffer() : width(0), height(0), format(PIXELS_FLOAT), rowBytes(0), rows(NULL) {}
+};
+
+void resizeFramebuffer(Framebuffer &framebuffer, int width, int height, PixelFormat format);
+void fillFramebuffer(Framebuffer &framebuffer, const colour3 &colour);
+colour3 loadPixel(const Framebuffer &framebuffer, int x, int y);
+void storePixel(Framebuffer &framebuffer, int x, int y, const colour3 &colour);
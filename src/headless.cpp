@@ -0,0 +1,148 @@
+// Renders a scene without a window and writes the image to disk, for machines with no display.
+
+#include "image.h"
+#include "raytracer.h"
+#include "renderer.h"
+#include "tasks.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+static void usage() {
+	std::cerr << "Usage: headless [scene] [--size=WIDTHxHEIGHT] [--output=FILE.png|FILE.ppm] [--repeat=N] [--band-rows=N] [options]\n";
+}
+
+// images with more pixels than this are rendered and written in bands unless --band-rows says otherwise
+const long long LARGE_IMAGE_PIXELS = 4096 * 4096;
+const int LARGE_IMAGE_BAND_ROWS = 256;
+
+/*
+render an image a band of rows at a time from the top down, writing each band as soon as it is done
+	render: render to reuse for every band
+	image: open writer for the image
+	width, height: size of the image in pixels
+	bandRows: rows in each band
+	seconds: output time spent rendering
+	samples: output camera rays traced
+	returns false if the image could not be written
+*/
+static bool renderBands(Render &render, ImageWriter &image, int width, int height, int bandRows, double &seconds, long long &samples) {
+	// the edge pass compares each pixel with the rows above and below, so bands are traced
+	// with an extra row on either side when anti-aliasing, and those rows are not written
+	int margin = aaSamples > 1 ? 1 : 0;
+	seconds = 0;
+	samples = 0;
+
+	for (int top = height; top > 0; top -= bandRows) {
+		int bottom = std::max(0, top - bandRows);
+		startBand(render, width, height, bottom, top, margin);
+		finishRender(render);
+
+		seconds += render.seconds;
+		samples += render.samples;
+		if (!writeRows(image, render.pixels, bottom - render.originY, top - render.originY))
+			return false;
+	}
+
+	return closeImage(image);
+}
+
+int main(int argc, char **argv) {
+	char *sceneName = NULL;
+	int width = 512, height = 512;
+	int repeat = 1;
+	int bandRows = 0;
+	std::string output;
+
+	// nobody sees the coarse passes, so they are only traced when asked for
+	progressive = false;
+
+	// options start with --, anything else is the scene name
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+
+		if (strncmp(argv[i], "--", 2) != 0) {
+			sceneName = argv[i];
+		}
+		else if (arg.compare(0, 7, "--size=") == 0) {
+			if (sscanf(arg.c_str() + 7, "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+				usage();
+				return EXIT_FAILURE;
+			}
+		}
+		else if (arg.compare(0, 9, "--output=") == 0) {
+			output = arg.substr(9);
+		}
+		else if (arg.compare(0, 9, "--repeat=") == 0) {
+			repeat = atoi(arg.c_str() + 9);
+			if (repeat < 1) {
+				usage();
+				return EXIT_FAILURE;
+			}
+		}
+		else if (arg.compare(0, 12, "--band-rows=") == 0) {
+			bandRows = atoi(arg.c_str() + 12);
+			if (bandRows < 1) {
+				usage();
+				return EXIT_FAILURE;
+			}
+		}
+		else if (!parseOption(arg)) {
+			std::cerr << "Unknown option " << arg << std::endl;
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (output.empty()) {
+		output = std::string(sceneName != NULL ? sceneName : "c") + ".png";
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	choose_scene(sceneName);
+	double loadSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	if (bandRows == 0) {
+		bandRows = (long long)width * height > LARGE_IMAGE_PIXELS ? LARGE_IMAGE_BAND_ROWS : height;
+	}
+
+	// each run renders the whole image again and writes it, the best time (spent rendering only)
+	// is the least disturbed by the rest of the machine
+	static Render render;
+	double best = 0, total = 0;
+	long long samples = 0;
+	resetRayStats();
+
+	for (int run = 0; run < repeat; run++) {
+		ImageWriter image;
+		double seconds;
+
+		if (!openImage(image, output, width, height) || !renderBands(render, image, width, height, bandRows, seconds, samples)) {
+			std::cerr << "Unable to write " << output << std::endl;
+			return EXIT_FAILURE;
+		}
+
+		best = run == 0 ? seconds : std::min(best, seconds);
+		total += seconds;
+		std::cout << "Run " << run + 1 << ": " << seconds << "s\n";
+	}
+
+	long long rays, culled, lookups, hits;
+	rayStats(rays, culled);
+	occluderCacheStats(lookups, hits);
+	rays /= repeat;
+	culled /= repeat;
+
+	std::cout << "Wrote " << output << "\n";
+	std::cout << "Scene loaded in " << loadSeconds << "s\n";
+	std::cout << "Rendered " << width << "x" << height << (bandRows < height ? " in bands of " + std::to_string(bandRows) + " rows" : "") << " on " << workerCount() << " threads: best " << best << "s, mean " << total / repeat << "s over " << repeat << " runs\n";
+	std::cout << "Rays per frame: " << rays << " traced (" << rays / best / 1e6 << " million per second), " << culled << " culled\n";
+	std::cout << "Shadow occluder cache hits: " << hits << " of " << lookups << " lookups\n";
+	std::cout << "Samples per pixel: " << double(samples) / (double(width) * height) << "\n";
+
+	return EXIT_SUCCESS;
+}
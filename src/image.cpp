@@ -0,0 +1,192 @@
+/*
+	Image output
+	PNGs are written with stored (uncompressed) deflate blocks, so no compression
+	library is needed; they are as large as a PPM but open everywhere. Both formats
+	are written a band of rows at a time, so a renderer can write an image larger
+	than it could hold: each band of a PNG is its own IDAT chunk, and the zlib
+	stream's checksum is carried from one band to the next.
+*/
+
+#include "image.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <vector>
+
+/*
+convert rows of a framebuffer to 8 bit RGB, top row first
+	framebuffer: rendered pixels
+	y0, y1: first row and one past the last row to convert, from the bottom
+	bytes: output bytes, 3 per pixel
+*/
+static void rowBytes(const Framebuffer &framebuffer, int y0, int y1, std::vector<unsigned char> &bytes) {
+	bytes.resize(size_t(framebuffer.width) * (y1 - y0) * 3);
+
+	for (int y = y1 - 1; y >= y0; y--) {
+		unsigned char *out = &bytes[size_t(y1 - 1 - y) * framebuffer.width * 3];
+
+		for (int x = 0; x < framebuffer.width; x++) {
+			colour3 colour = loadPixel(framebuffer, x, y);
+			for (int c = 0; c < 3; c++) {
+				out[x * 3 + c] = (unsigned char)(glm::clamp(colour[c], 0.0f, 1.0f) * 255.0f + 0.5f);
+			}
+		}
+	}
+}
+
+static uint32_t crc32(const unsigned char *data, size_t size, uint32_t crc = 0) {
+	static uint32_t table[256];
+	if (table[1] == 0) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++) {
+				c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			}
+			table[i] = c;
+		}
+	}
+
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++) {
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+static void putBigEndian(std::vector<unsigned char> &out, uint32_t value) {
+	out.push_back((unsigned char)(value >> 24));
+	out.push_back((unsigned char)(value >> 16));
+	out.push_back((unsigned char)(value >> 8));
+	out.push_back((unsigned char)value);
+}
+
+// append a PNG chunk (length, type, data and the CRC of type and data)
+static void putChunk(std::vector<unsigned char> &out, const char *type, const std::vector<unsigned char> &data) {
+	putBigEndian(out, uint32_t(data.size()));
+	size_t start = out.size();
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data.begin(), data.end());
+	putBigEndian(out, crc32(&out[start], out.size() - start));
+}
+
+/*
+create an image file and write its header, as a PNG if the path ends in .png and a binary PPM otherwise
+	image: output writer
+	path: file to write
+	width, height: size of the image in pixels
+	returns false if the file could not be created
+*/
+bool openImage(ImageWriter &image, const std::string &path, int width, int height) {
+	image.out.open(path, std::ios::binary);
+	if (!image.out.is_open())
+		return false;
+
+	image.png = path.size() >= 4 && path.compare(path.size() - 4, 4, ".png") == 0;
+	image.width = width;
+	image.height = height;
+	image.rowsWritten = 0;
+	image.adlerA = 1;
+	image.adlerB = 0;
+
+	if (!image.png) {
+		image.out << "P6\n" << width << " " << height << "\n255\n";
+		return bool(image.out);
+	}
+
+	std::vector<unsigned char> header;
+	putBigEndian(header, uint32_t(width));
+	putBigEndian(header, uint32_t(height));
+	header.push_back(8); // bits per channel
+	header.push_back(2); // RGB
+	header.push_back(0); // deflate
+	header.push_back(0); // adaptive filtering
+	header.push_back(0); // not interlaced
+
+	const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	std::vector<unsigned char> png(signature, signature + 8);
+	putChunk(png, "IHDR", header);
+
+	image.out.write((const char *)png.data(), png.size());
+	return bool(image.out);
+}
+
+/*
+append the next rows of the image, which is written from the top down
+	image: an open writer
+	framebuffer: pixels holding the rows
+	y0, y1: first row and one past the last row of the framebuffer to write, from the bottom
+	returns false if the rows could not be written
+*/
+bool writeRows(ImageWriter &image, const Framebuffer &framebuffer, int y0, int y1) {
+	std::vector<unsigned char> bytes;
+	rowBytes(framebuffer, y0, y1, bytes);
+	size_t size = size_t(image.width) * 3;
+	int rows = y1 - y0;
+	image.rowsWritten += rows;
+
+	if (!image.png) {
+		image.out.write((const char *)bytes.data(), bytes.size());
+		return bool(image.out);
+	}
+
+	// every row starts with its filter type, 0 (none)
+	std::vector<unsigned char> raw;
+	raw.reserve((size + 1) * rows);
+	for (int y = 0; y < rows; y++) {
+		raw.push_back(0);
+		raw.insert(raw.end(), bytes.begin() + y * size, bytes.begin() + (y + 1) * size);
+	}
+
+	for (size_t i = 0; i < raw.size(); i++) {
+		image.adlerA = (image.adlerA + raw[i]) % 65521;
+		image.adlerB = (image.adlerB + image.adlerA) % 65521;
+	}
+
+	// each call adds an IDAT chunk continuing one zlib stream of stored blocks of at most 65535 bytes
+	std::vector<unsigned char> zlib;
+	if (image.rowsWritten == rows) {
+		zlib.push_back(0x78);
+		zlib.push_back(0x01);
+	}
+
+	bool lastRows = image.rowsWritten == image.height;
+	size_t offset = 0;
+	do {
+		size_t block = std::min(raw.size() - offset, size_t(65535));
+		bool last = lastRows && offset + block == raw.size();
+
+		zlib.push_back(last ? 1 : 0);
+		zlib.push_back((unsigned char)block);
+		zlib.push_back((unsigned char)(block >> 8));
+		zlib.push_back((unsigned char)~block);
+		zlib.push_back((unsigned char)(~block >> 8));
+		zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + block);
+		offset += block;
+	} while (offset < raw.size());
+
+	std::vector<unsigned char> chunk;
+	putChunk(chunk, "IDAT", zlib);
+	image.out.write((const char *)chunk.data(), chunk.size());
+	return bool(image.out);
+}
+
+/*
+finish an image once all of its rows are written
+	image: an open writer
+	returns false if the file could not be written
+*/
+bool closeImage(ImageWriter &image) {
+	if (image.png) {
+		std::vector<unsigned char> adler;
+		putBigEndian(adler, (image.adlerB << 16) | image.adlerA);
+
+		std::vector<unsigned char> end;
+		putChunk(end, "IDAT", adler);
+		putChunk(end, "IEND", std::vector<unsigned char>());
+		image.out.write((const char *)end.data(), end.size());
+	}
+
+	image.out.close();
+	return !image.out.fail() && image.rowsWritten == image.height;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+// Writes rendered images to disk as binary PPM or PNG, chosen by the file extension,
+// a band of rows at a time from the top of the image down.
+
+#include "framebuffer.h"
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+struct ImageWriter {
+	std::ofstream out;
+	bool png;
+	int width, height;
+	int rowsWritten;
+	uint32_t adlerA, adlerB; // Adler-32 sums of the PNG data written so far
+};
+
+bool openImage(ImageWriter &image, const std::string &path, int width, int height);
+bool writeRows(ImageWriter &image, const Framebuffer &framebuffer, int y0, int y1);
+bool closeImage(ImageWriter &image);
@@ -2,7 +2,9 @@
 // Modified to isolate the main program and use GLM
 
  #include "common.h"
+#include "raytracer.h"
 
+#include <cstring>
 #include <iostream>
 
 // Create a NULL-terminated string by reading the provided file
@@ -116,7 +118,18 @@ main( int argc, char **argv )
 
    glewInit();
 
-   init(argc > 1 ? argv[1] : NULL);
+   // options start with --, anything else is the scene name
+   char *scene = NULL;
+   for ( int i = 1; i < argc; ++i ) {
+      if ( strncmp( argv[i], "--", 2 ) != 0 ) {
+         scene = argv[i];
+      } else if ( !parseOption( argv[i] ) ) {
+         std::cerr << "Unknown option " << argv[i] << std::endl;
+         exit( EXIT_FAILURE );
+      }
+   }
+
+   init(scene);
 
    glutDisplayFunc( display );
    glutKeyboardFunc( keyboard );
@@ -0,0 +1,102 @@
+/*
+	Mapped files
+	Files are mapped copy-on-write rather than read-only so the arrays viewing them
+	can hand out writable references like a vector does; nothing written to them
+	ever reaches the file.
+*/
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "mapped.h"
+
+#ifdef _WIN32
+
+MappedFile::MappedFile() : data(NULL), size(0), file(INVALID_HANDLE_VALUE), mapping(NULL) {}
+
+MappedFile::~MappedFile() {
+	if (data != NULL) {
+		UnmapViewOfFile(data);
+	}
+	if (mapping != NULL) {
+		CloseHandle(mapping);
+	}
+	if (file != INVALID_HANDLE_VALUE) {
+		CloseHandle(file);
+	}
+}
+
+/*
+map a whole file into memory
+	path: file to map
+	returns the mapping, or null if the file could not be opened or is empty
+*/
+std::shared_ptr<MappedFile> mapFile(const std::string &path) {
+	std::shared_ptr<MappedFile> mapped(new MappedFile());
+
+	mapped->file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (mapped->file == INVALID_HANDLE_VALUE)
+		return NULL;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(mapped->file, &size) || size.QuadPart == 0)
+		return NULL;
+
+	mapped->mapping = CreateFileMappingA(mapped->file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	if (mapped->mapping == NULL)
+		return NULL;
+
+	mapped->data = MapViewOfFile(mapped->mapping, FILE_MAP_COPY, 0, 0, 0);
+	if (mapped->data == NULL)
+		return NULL;
+
+	mapped->size = size_t(size.QuadPart);
+	return mapped;
+}
+
+#else
+
+MappedFile::MappedFile() : data(NULL), size(0), file(-1) {}
+
+MappedFile::~MappedFile() {
+	if (data != NULL) {
+		munmap(data, size);
+	}
+	if (file >= 0) {
+		close(file);
+	}
+}
+
+/*
+map a whole file into memory
+	path: file to map
+	returns the mapping, or null if the file could not be opened or is empty
+*/
+std::shared_ptr<MappedFile> mapFile(const std::string &path) {
+	std::shared_ptr<MappedFile> mapped(new MappedFile());
+
+	mapped->file = open(path.c_str(), O_RDONLY);
+	if (mapped->file < 0)
+		return NULL;
+
+	struct stat status;
+	if (fstat(mapped->file, &status) != 0 || status.st_size == 0)
+		return NULL;
+
+	void *data = mmap(NULL, size_t(status.st_size), PROT_READ | PROT_WRITE, MAP_PRIVATE, mapped->file, 0);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	mapped->data = data;
+	mapped->size = size_t(status.st_size);
+	return mapped;
+}
+
+#endif
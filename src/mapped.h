@@ -0,0 +1,219 @@
+#pragma once
+
+// Read-only files mapped into memory, and arrays that are either built in memory or point
+// into such a file, so data loaded from disk is used in place without being copied.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// A file mapped copy-on-write: its pages are shared with every other process mapping the
+// same file (and with the page cache) until one of them is written to.
+struct MappedFile {
+	void *data;
+	size_t size;
+#ifdef _WIN32
+	void *file, *mapping;
+#else
+	int file;
+#endif
+
+	MappedFile();
+	~MappedFile();
+
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+};
+
+std::shared_ptr<MappedFile> mapFile(const std::string &path);
+
+// An array of plain structs that is either built up in memory like a vector, or is a view of
+// part of a mapped file. Changing a view copies it into memory first.
+template <class T>
+class MappedArray {
+public:
+	MappedArray() : items(NULL), count(0), mapped(false) {}
+
+	MappedArray(const MappedArray &other) : items(NULL), count(0), mapped(false) {
+		*this = other;
+	}
+
+	MappedArray &operator=(const MappedArray &other) {
+		if (other.mapped) {
+			view(other.items, other.count);
+		}
+		else {
+			owned = other.owned;
+			mapped = false;
+			update();
+		}
+		return *this;
+	}
+
+	/*
+	make the array a view of memory it does not own
+		first: first item, which must stay valid (mapped) while the array is used
+		n: number of items
+	*/
+	void view(T *first, size_t n) {
+		std::vector<T>().swap(owned);
+		items = first;
+		count = n;
+		mapped = true;
+	}
+
+	bool isMapped() const { return mapped; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+	T &operator[](size_t i) { return items[i]; }
+	const T &operator[](size_t i) const { return items[i]; }
+	T *data() { return items; }
+	const T *data() const { return items; }
+	T &back() { return items[count - 1]; }
+	const T &back() const { return items[count - 1]; }
+	const T *begin() const { return items; }
+	const T *end() const { return items + count; }
+
+	void push_back(const T &item) {
+		own();
+		owned.push_back(item);
+		update();
+	}
+
+	void resize(size_t n, const T &item = T()) {
+		own();
+		owned.resize(n, item);
+		update();
+	}
+
+	void assign(size_t n, const T &item) {
+		mapped = false;
+		owned.assign(n, item);
+		update();
+	}
+
+	void reserve(size_t n) {
+		own();
+		owned.reserve(n);
+		update();
+	}
+
+	void clear() {
+		mapped = false;
+		owned.clear();
+		update();
+	}
+
+	// exchange the items with a vector's, after which the array is in memory
+	void swap(std::vector<T> &other) {
+		own();
+		owned.swap(other);
+		update();
+	}
+
+private:
+	std::vector<T> owned;
+	T *items;
+	size_t count;
+	bool mapped;
+
+	// copy a view into memory before changing it
+	void own() {
+		if (mapped) {
+			owned.assign(items, items + count);
+			mapped = false;
+		}
+	}
+
+	void update() {
+		items = owned.empty() ? NULL : owned.data();
+		count = owned.size();
+	}
+};
+
+// written as is in the header of files made to be mapped, so a machine with a different byte
+// order can tell it did not make the file
+const uint32_t FILE_BYTE_ORDER_MARK = 0x01020304;
+
+// arrays in files made to be mapped start on multiples of this, which also aligns them in
+// memory as files are mapped at page boundaries
+const uint64_t FILE_ARRAY_ALIGNMENT = 64;
+
+// Where an array of raw structs is stored in a file made to be mapped.
+struct FileArray {
+	uint64_t offset; // from the start of the file
+	uint64_t count;
+	uint32_t itemSize; // size of one item when written, which must match the reader's
+	uint32_t unused;
+};
+
+/*
+place an array after the ones placed before it
+	array: output location of the array
+	items: array to place
+	offset: end of the arrays placed so far, moved past this one
+*/
+template <class T>
+void placeArray(FileArray &array, const MappedArray<T> &items, uint64_t &offset) {
+	offset = (offset + FILE_ARRAY_ALIGNMENT - 1) / FILE_ARRAY_ALIGNMENT * FILE_ARRAY_ALIGNMENT;
+
+	array.offset = offset;
+	array.count = items.size();
+	array.itemSize = sizeof(T);
+	array.unused = 0;
+
+	offset += items.size() * sizeof(T);
+}
+
+/*
+zero the padding bytes of an item before it is written, so files never hold leftover memory;
+structs with padding overload this
+	item: copy of the item to write
+*/
+template <class T>
+void clearPadding(T &) {}
+
+/*
+write an array where it was placed, which must not be before the end of the file so far
+	out: file being written
+	array: location of the array
+	items: array to write
+*/
+template <class T>
+void writeArray(std::ofstream &out, const FileArray &array, const MappedArray<T> &items) {
+	static const char zeros[FILE_ARRAY_ALIGNMENT] = {};
+	out.write(zeros, std::streamsize(array.offset - uint64_t(out.tellp())));
+
+	// copied out a chunk at a time so the padding can be cleared without changing the array
+	const size_t CHUNK_ITEMS = 4096;
+	std::vector<T> chunk;
+	for (size_t first = 0; first < items.size(); first += CHUNK_ITEMS) {
+		chunk.assign(items.begin() + first, items.begin() + std::min(items.size(), first + CHUNK_ITEMS));
+		for (T &item : chunk) {
+			clearPadding(item);
+		}
+		out.write((const char *)chunk.data(), std::streamsize(chunk.size() * sizeof(T)));
+	}
+}
+
+/*
+make an array a view of its part of a mapped file
+	file: mapped file
+	array: location of the array
+	items: output view
+	returns false if the array does not fit in the file or was written with a different item size
+*/
+template <class T>
+bool viewArray(const MappedFile &file, const FileArray &array, MappedArray<T> &items) {
+	if (array.itemSize != sizeof(T) || array.offset % FILE_ARRAY_ALIGNMENT != 0 || array.offset > file.size
+		|| array.count > (file.size - array.offset) / sizeof(T))
+		return false;
+
+	items.view((T *)((char *)file.data + array.offset), size_t(array.count));
+	return true;
+}
@@ -0,0 +1,476 @@
+/*
+	Mesh files
+	Only positions and faces are read; normals, texture coordinates, groups and
+	materials are skipped. Polygons are split into fans of triangles around their
+	first corner. Files are mapped rather than read, so large binary PLY files go
+	straight from the page cache into the vertex buffer.
+*/
+
+#include "meshfile.h"
+#include "mapped.h"
+
+#include <cctype>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+// A position in a mapped file, which is not null terminated.
+struct Cursor {
+	const char *p;
+	const char *end;
+};
+
+static bool isSpace(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f' || c == '\v';
+}
+
+/*
+get the next whitespace separated token on the current line
+	cursor: position to read from, moved past the token
+	token, length: output token
+	returns false at the end of the line
+*/
+static bool lineToken(Cursor &cursor, const char *&token, size_t &length) {
+	while (cursor.p < cursor.end && (*cursor.p == ' ' || *cursor.p == '\t' || *cursor.p == '\r')) {
+		cursor.p++;
+	}
+	token = cursor.p;
+	while (cursor.p < cursor.end && !isSpace(*cursor.p)) {
+		cursor.p++;
+	}
+	length = size_t(cursor.p - token);
+	return length > 0;
+}
+
+// get the next whitespace separated token on any line, returns false at the end of the file
+static bool token(Cursor &cursor, const char *&start, size_t &length) {
+	while (cursor.p < cursor.end && isSpace(*cursor.p)) {
+		cursor.p++;
+	}
+	return lineToken(cursor, start, length);
+}
+
+static void skipLine(Cursor &cursor) {
+	while (cursor.p < cursor.end && *cursor.p != '\n') {
+		cursor.p++;
+	}
+	if (cursor.p < cursor.end) {
+		cursor.p++;
+	}
+}
+
+static bool tokenIs(const char *token, size_t length, const char *word) {
+	return length == strlen(word) && memcmp(token, word, length) == 0;
+}
+
+/*
+parse a number token, which is copied so strtod cannot read past the end of the file
+	token, length: token to parse
+	value: output number
+	returns false if the token is not a number
+*/
+static bool parseNumber(const char *token, size_t length, double &value) {
+	char text[64];
+	if (length == 0 || length >= sizeof(text))
+		return false;
+
+	memcpy(text, token, length);
+	text[length] = 0;
+	char *end;
+	value = strtod(text, &end);
+	return end == text + length;
+}
+
+/*
+read a Wavefront OBJ file
+	cursor: contents of the file
+	vertices, indices: output mesh, three indices per triangle
+	error: output description of what was wrong with the file
+*/
+static bool loadObj(Cursor cursor, std::vector<glm::vec3> &vertices, std::vector<int> &indices, std::string &error) {
+	std::vector<int> polygon;
+
+	while (cursor.p < cursor.end) {
+		const char *start;
+		size_t length;
+		if (!lineToken(cursor, start, length)) {
+			skipLine(cursor);
+			continue;
+		}
+
+		if (tokenIs(start, length, "v")) {
+			glm::vec3 v;
+			for (int k = 0; k < 3; k++) {
+				double c;
+				if (!lineToken(cursor, start, length) || !parseNumber(start, length, c)) {
+					error = "a vertex must have 3 coordinates";
+					return false;
+				}
+				v[k] = float(c);
+			}
+			vertices.push_back(v);
+		}
+		else if (tokenIs(start, length, "f")) {
+			// corners are v, v/vt, v//vn or v/vt/vn, with negative v counting back from the last vertex
+			polygon.clear();
+			while (lineToken(cursor, start, length)) {
+				const char *slash = (const char *)memchr(start, '/', length);
+				double v;
+				if (!parseNumber(start, slash != NULL ? size_t(slash - start) : length, v) || v == 0 || !(v >= -INT_MAX && v <= INT_MAX) || v != double(int(v))) {
+					error = "a face corner must start with a vertex number";
+					return false;
+				}
+				polygon.push_back(v < 0 ? int(vertices.size()) + int(v) : int(v) - 1);
+			}
+
+			if (polygon.size() < 3) {
+				error = "a face must have at least 3 corners";
+				return false;
+			}
+			for (size_t i = 1; i + 1 < polygon.size(); i++) {
+				indices.push_back(polygon[0]);
+				indices.push_back(polygon[i]);
+				indices.push_back(polygon[i + 1]);
+			}
+		}
+		skipLine(cursor);
+	}
+
+	return true;
+}
+
+enum PlyFormat {
+	PLY_ASCII,
+	PLY_LITTLE_ENDIAN,
+	PLY_BIG_ENDIAN
+};
+
+enum PlyType {
+	PLY_INT8,
+	PLY_UINT8,
+	PLY_INT16,
+	PLY_UINT16,
+	PLY_INT32,
+	PLY_UINT32,
+	PLY_FLOAT32,
+	PLY_FLOAT64,
+	PLY_UNKNOWN
+};
+
+struct PlyProperty {
+	std::string name;
+	PlyType type;
+	bool isList;
+	PlyType countType; // of a list's length, which comes before its items
+};
+
+struct PlyElement {
+	std::string name;
+	size_t count;
+	std::vector<PlyProperty> properties;
+};
+
+static PlyType plyType(const char *token, size_t length) {
+	const char *names[][2] = {
+		{ "char", "int8" }, { "uchar", "uint8" }, { "short", "int16" }, { "ushort", "uint16" },
+		{ "int", "int32" }, { "uint", "uint32" }, { "float", "float32" }, { "double", "float64" }
+	};
+	for (int t = 0; t < PLY_UNKNOWN; t++) {
+		if (tokenIs(token, length, names[t][0]) || tokenIs(token, length, names[t][1]))
+			return PlyType(t);
+	}
+	return PLY_UNKNOWN;
+}
+
+static size_t plySize(PlyType type) {
+	const size_t sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+	return sizes[type];
+}
+
+/*
+fewest bytes one item of a PLY element can take, so counts can be checked against the file
+before anything is allocated for them; an ASCII value takes at least a byte and a list
+at least its length
+	element: element with its properties
+	format: how the values are stored
+*/
+static size_t plyMinimumSize(const PlyElement &element, PlyFormat format) {
+	size_t size = 0;
+	for (const PlyProperty &property : element.properties) {
+		if (format == PLY_ASCII) {
+			size++;
+		}
+		else {
+			size += plySize(property.isList ? property.countType : property.type);
+		}
+	}
+	return size > 0 ? size : 1;
+}
+
+/*
+read one value of a PLY element
+	cursor: position of the value, moved past it
+	format: how the values are stored
+	type: type of the value
+	value: output value
+	returns false at the end of the file or on a token that is not a number
+*/
+static bool readPlyValue(Cursor &cursor, PlyFormat format, PlyType type, double &value) {
+	if (format == PLY_ASCII) {
+		const char *start;
+		size_t length;
+		return token(cursor, start, length) && parseNumber(start, length, value);
+	}
+
+	size_t size = plySize(type);
+	if (size_t(cursor.end - cursor.p) < size)
+		return false;
+
+	unsigned char bytes[8];
+	memcpy(bytes, cursor.p, size);
+	cursor.p += size;
+
+	// files are read on little endian machines (x86 and x64)
+	if (format == PLY_BIG_ENDIAN) {
+		for (size_t i = 0; i < size / 2; i++) {
+			unsigned char b = bytes[i];
+			bytes[i] = bytes[size - 1 - i];
+			bytes[size - 1 - i] = b;
+		}
+	}
+
+	switch (type) {
+	case PLY_INT8: { int8_t v; memcpy(&v, bytes, 1); value = v; break; }
+	case PLY_UINT8: { uint8_t v; memcpy(&v, bytes, 1); value = v; break; }
+	case PLY_INT16: { int16_t v; memcpy(&v, bytes, 2); value = v; break; }
+	case PLY_UINT16: { uint16_t v; memcpy(&v, bytes, 2); value = v; break; }
+	case PLY_INT32: { int32_t v; memcpy(&v, bytes, 4); value = v; break; }
+	case PLY_UINT32: { uint32_t v; memcpy(&v, bytes, 4); value = v; break; }
+	case PLY_FLOAT32: { float v; memcpy(&v, bytes, 4); value = v; break; }
+	default: { double v; memcpy(&v, bytes, 8); value = v; break; }
+	}
+	return true;
+}
+
+/*
+read a PLY file: the x, y and z properties of its vertex element and the vertex_indices
+(or vertex_index) list of its face element, any other elements and properties are skipped
+	cursor: contents of the file
+	vertices, indices: output mesh, three indices per triangle
+	error: output description of what was wrong with the file
+*/
+static bool loadPly(Cursor cursor, std::vector<glm::vec3> &vertices, std::vector<int> &indices, std::string &error) {
+	PlyFormat format = PLY_ASCII;
+	bool hasFormat = false;
+	std::vector<PlyElement> elements;
+
+	// the header is lines of text up to end_header
+	skipLine(cursor);
+	for (;;) {
+		const char *start;
+		size_t length;
+		if (cursor.p >= cursor.end) {
+			error = "the PLY header has no end_header";
+			return false;
+		}
+		if (!lineToken(cursor, start, length)) {
+			skipLine(cursor);
+			continue;
+		}
+
+		if (tokenIs(start, length, "end_header")) {
+			skipLine(cursor);
+			break;
+		}
+		else if (tokenIs(start, length, "format")) {
+			lineToken(cursor, start, length);
+			hasFormat = true;
+			if (tokenIs(start, length, "ascii")) {
+				format = PLY_ASCII;
+			}
+			else if (tokenIs(start, length, "binary_little_endian")) {
+				format = PLY_LITTLE_ENDIAN;
+			}
+			else if (tokenIs(start, length, "binary_big_endian")) {
+				format = PLY_BIG_ENDIAN;
+			}
+			else {
+				error = "unknown PLY format " + std::string(start, length);
+				return false;
+			}
+		}
+		else if (tokenIs(start, length, "element")) {
+			PlyElement element;
+			double count;
+			lineToken(cursor, start, length);
+			element.name.assign(start, length);
+			if (!lineToken(cursor, start, length) || !parseNumber(start, length, count) || !(count >= 0)) {
+				error = "a PLY element must have a count";
+				return false;
+			}
+			if (count > double(cursor.end - cursor.p)) {
+				error = "the PLY header claims more data than the file holds";
+				return false;
+			}
+			if (count > INT_MAX) {
+				error = "a PLY element has more items than a mesh can hold";
+				return false;
+			}
+			element.count = size_t(count);
+			elements.push_back(element);
+		}
+		else if (tokenIs(start, length, "property")) {
+			if (elements.empty()) {
+				error = "a PLY property must follow an element";
+				return false;
+			}
+
+			PlyProperty property;
+			lineToken(cursor, start, length);
+			property.isList = tokenIs(start, length, "list");
+			property.countType = PLY_UNKNOWN;
+			if (property.isList) {
+				lineToken(cursor, start, length);
+				property.countType = plyType(start, length);
+				lineToken(cursor, start, length);
+			}
+			property.type = plyType(start, length);
+			lineToken(cursor, start, length);
+			property.name.assign(start, length);
+
+			if (property.type == PLY_UNKNOWN || (property.isList && property.countType == PLY_UNKNOWN)) {
+				error = "unknown type of PLY property " + property.name;
+				return false;
+			}
+			elements.back().properties.push_back(property);
+		}
+		skipLine(cursor);
+	}
+
+	if (!hasFormat) {
+		error = "the PLY header has no format";
+		return false;
+	}
+
+	size_t left = size_t(cursor.end - cursor.p);
+	for (const PlyElement &element : elements) {
+		size_t size = plyMinimumSize(element, format);
+		if (element.count > left / size) {
+			error = "the PLY header claims more data than the file holds";
+			return false;
+		}
+		left -= element.count * size;
+	}
+
+	std::vector<int> polygon;
+	for (const PlyElement &element : elements) {
+		bool isVertex = element.name == "vertex", isFace = element.name == "face";
+		if (isVertex) {
+			vertices.reserve(element.count);
+		}
+
+		for (size_t i = 0; i < element.count; i++) {
+			glm::vec3 v(0.0f, 0.0f, 0.0f);
+			polygon.clear();
+
+			for (const PlyProperty &property : element.properties) {
+				double value;
+				if (!property.isList) {
+					if (!readPlyValue(cursor, format, property.type, value)) {
+						error = "the PLY " + element.name + " data is cut short or not a number";
+						return false;
+					}
+					if (isVertex && property.name.size() == 1 && property.name[0] >= 'x' && property.name[0] <= 'z') {
+						v[property.name[0] - 'x'] = float(value);
+					}
+					continue;
+				}
+
+				double count;
+				if (!readPlyValue(cursor, format, property.countType, count)
+					|| !(count >= 0 && count <= double(cursor.end - cursor.p) / (format == PLY_ASCII ? 1 : plySize(property.type)))) {
+					error = "the PLY " + element.name + " data is cut short or not a number";
+					return false;
+				}
+				bool isCorners = isFace && (property.name == "vertex_indices" || property.name == "vertex_index");
+				for (size_t k = 0; k < size_t(count); k++) {
+					if (!readPlyValue(cursor, format, property.type, value)) {
+						error = "the PLY " + element.name + " data is cut short or not a number";
+						return false;
+					}
+					if (isCorners) {
+						if (!(value >= 0 && value <= INT_MAX)) {
+							error = "a face uses a vertex that does not exist";
+							return false;
+						}
+						polygon.push_back(int(value));
+					}
+				}
+			}
+
+			if (isVertex) {
+				vertices.push_back(v);
+			}
+			for (size_t k = 1; k + 1 < polygon.size(); k++) {
+				indices.push_back(polygon[0]);
+				indices.push_back(polygon[k]);
+				indices.push_back(polygon[k + 1]);
+			}
+		}
+	}
+
+	return true;
+}
+
+static bool endsWith(const std::string &s, const std::string &suffix) {
+	if (s.size() < suffix.size())
+		return false;
+
+	for (size_t i = 0; i < suffix.size(); i++) {
+		if (tolower(s[s.size() - suffix.size() + i]) != suffix[i])
+			return false;
+	}
+	return true;
+}
+
+/*
+read a triangle mesh from an OBJ or PLY file
+	path: file to read, its extension (.obj or .ply) gives its format
+	vertices: output vertex positions
+	indices: output triangles, three indices into vertices each
+	error: output description of what was wrong with the file
+	returns false if the file could not be read
+*/
+bool loadMeshFile(const std::string &path, std::vector<glm::vec3> &vertices, std::vector<int> &indices, std::string &error) {
+	vertices.clear();
+	indices.clear();
+
+	bool isObj = endsWith(path, ".obj"), isPly = endsWith(path, ".ply");
+	if (!isObj && !isPly) {
+		error = "mesh files must be .obj or .ply";
+		return false;
+	}
+
+	std::shared_ptr<MappedFile> file = mapFile(path);
+	if (file == NULL) {
+		error = "unable to open the file or the file is empty";
+		return false;
+	}
+
+	Cursor cursor = { (const char *)file->data, (const char *)file->data + file->size };
+	if (isPly && (file->size < 3 || memcmp(cursor.p, "ply", 3) != 0)) {
+		error = "not a PLY file";
+		return false;
+	}
+	if (!(isObj ? loadObj(cursor, vertices, indices, error) : loadPly(cursor, vertices, indices, error)))
+		return false;
+
+	for (int index : indices) {
+		if (index < 0 || index >= int(vertices.size())) {
+			error = "a face uses a vertex that does not exist";
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+// Triangle meshes read from Wavefront OBJ and PLY (ASCII or binary) files, for scene mesh
+// objects that name a file instead of listing their triangles.
+
+#include <glm/glm.hpp>
+
+#include <string>
+#include <vector>
+
+bool loadMeshFile(const std::string &path, std::vector<glm::vec3> &vertices, std::vector<int> &indices, std::string &error);
@@ -5,46 +5,67 @@
 
 #include "common.h"
 #include "raytracer.h"
+#include "renderer.h"
 
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <memory>
+#include <vector>
 
 #include <glm/glm.hpp>
 
 const char *WINDOW_TITLE = "Ray Tracing";
-const double FRAME_RATE_MS = 1;
+const double FRAME_RATE_MS = 33; // the window is refreshed about 30 times a second
 
-colour3 texture[1<<16]; // big enough for a row of pixels
-point3 vertices[2]; // xy+u for start and end of line
-GLuint Window;
+glm::vec2 vertices[4] = { glm::vec2(-1, -1), glm::vec2(1, -1), glm::vec2(-1, 1), glm::vec2(1, 1) }; // quad covering the window
 int vp_width, vp_height;
-float drawing_y = 0;
+std::unique_ptr<Render> render(new Render()); // the frame being shown, traced in tiles on the task pool
+std::vector<std::unique_ptr<Render>> cancelled_renders; // frames cancelled while tracing, freed once their tasks are done
+bool start_frame = false; // a new frame should be started on the next refresh
+
+// the frame as shown, RGBA8 from the bottom row up; tiles are converted into it as they finish
+std::vector<unsigned int> framebuffer;
+std::vector<int> tile_passes; // passes of each tile in the framebuffer
+bool framebuffer_dirty = false;
+
+// pixel buffers the framebuffer is copied into, used in turn so the copy never waits on the upload of the last one
+GLuint pbos[2];
+int pbo_index = 0;
+GLuint textureID;
 
 point3 eye;
-float d = 1;
 
 //----------------------------------------------------------------------------
 
 point3 s(int x, int y) {
-	float aspect_ratio = (float)vp_width / vp_height;
-	float h = d * (float)tan((M_PI * fov) / 180.0 / 2.0);
-	float w = h * aspect_ratio;
-   
-	float top = h;
-	float bottom = -h;
-	float left = -w;
-	float right = w;
-   
-	float u = left + (right - left) * (x + 0.5f) / vp_width;
-	float v = bottom + (top - bottom) * (y + 0.5f) / vp_height;
-   
-	return point3(u, v, -d);
+	return cameraRay(x + 0.5f, y + 0.5f, vp_width, vp_height);
 }
 
 //----------------------------------------------------------------------------
 
+// skip the tiles not started yet and wait only for those being traced, so no task is left
+// reading the scene or a frame while they are destroyed; run at every exit, including the
+// one freeglut makes when the window is closed
+void finishRenders() {
+	cancelRender(*render);
+	for (size_t i = 0; i < cancelled_renders.size(); i++) {
+		cancelRender(*cancelled_renders[i]);
+	}
+	finishRender(*render);
+	for (size_t i = 0; i < cancelled_renders.size(); i++) {
+		finishRender(*cancelled_renders[i]);
+	}
+}
+
 // OpenGL initialization
 void init(char *fn) {
+	// the window thread only polls renders, so tracing never holds up input or refreshes
+	setCallerWaits(false);
 	choose_scene(fn);
+
+	// registered after the renders and the task pool are constructed, so it runs before they are destroyed
+	atexit(finishRenders);
    
 	// Create a vertex array object
 	GLuint vao;
@@ -55,7 +76,7 @@ void init(char *fn) {
 	GLuint buffer;
 	glGenBuffers( 1, &buffer );
 	glBindBuffer( GL_ARRAY_BUFFER, buffer );
-	glBufferData( GL_ARRAY_BUFFER, sizeof(vertices), NULL, GL_STATIC_DRAW );
+	glBufferData( GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW );
 
 	// Load shaders and use the resulting shader program
 	GLuint program = InitShader( "v.glsl", "f.glsl" );
@@ -64,74 +85,121 @@ void init(char *fn) {
 	// set up vertex arrays
 	GLuint vPos = glGetAttribLocation( program, "vPos" );
 	glEnableVertexAttribArray( vPos );
-	glVertexAttribPointer( vPos, 3, GL_FLOAT, GL_FALSE, 0, 0 );
-
-	Window = glGetUniformLocation( program, "Window" );
+	glVertexAttribPointer( vPos, 2, GL_FLOAT, GL_FALSE, 0, 0 );
 
 	// glClearColor( background_colour[0], background_colour[1], background_colour[2], 1 );
 	glClearColor( 0.7, 0.7, 0.8, 1 );
 
-	// set up a 1D texture for each scanline of output
-	GLuint textureID;
+	// set up a 2D texture holding the whole frame, sized in reshape
 	glGenTextures( 1, &textureID );
-	glBindTexture( GL_TEXTURE_1D, textureID );
-	glTexParameteri( GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
-	glTexParameteri( GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+	glBindTexture( GL_TEXTURE_2D, textureID );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+	glPixelStorei( GL_UNPACK_ALIGNMENT, 4 );
+
+	glGenBuffers( 2, pbos );
 }
 
 //----------------------------------------------------------------------------
 
-void display( void ) {
-	// draw one scanline at a time, to each buffer; only clear when we draw the first scanline
-	// (when fract(drawing_y) == 0.0, draw one buffer, when it is 0.5 draw the other)
-	
-	if (drawing_y <= 0.5) {
-		glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
+// copy the tiles that finished a pass since the last refresh from the render's preview into the framebuffer
+void collectTiles() {
+	for (int tile = 0; tile < render->tilesX * render->tilesY; tile++) {
+		int passes = tilePassesDone(*render, tile);
+		if (passes == tile_passes[tile])
+			continue;
 
-		glFlush();
-		glFinish();
-		glutSwapBuffers();
+		int x0, y0, x1, y1;
+		tileBounds(*render, tile, x0, y0, x1, y1);
 
-		drawing_y += 0.5;
+		for (int y = y0; y < y1; y++) {
+			for (int x = x0; x < x1; x++) {
+				framebuffer[y * vp_width + x] = render->preview[y * vp_width + x].load(std::memory_order_relaxed);
+			}
+		}
 
-	} else if (drawing_y >= 1.0 && drawing_y <= vp_height + 0.5) {
-		int y = int(drawing_y) - 1;
+		tile_passes[tile] = passes;
+		framebuffer_dirty = true;
+	}
+}
 
-		// only recalculate if this is a new scanline
-		if (drawing_y == int(drawing_y)) {
+// copy the framebuffer into the next pixel buffer and upload it to the texture from there
+void uploadFrame() {
+	GLsizeiptr size = GLsizeiptr(framebuffer.size() * sizeof(unsigned int));
 
-			for (int x = 0; x < vp_width; x++) {
-				if (!trace(eye, s(x, y), texture[x], false)) {
-					texture[x] = background_colour;
-				}
-			}
+	glBindBuffer( GL_PIXEL_UNPACK_BUFFER, pbos[pbo_index] );
+	void *mapped = glMapBufferRange( GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT );
+	if (mapped != NULL) {
+		memcpy(mapped, framebuffer.data(), size);
+		glUnmapBuffer( GL_PIXEL_UNPACK_BUFFER );
+
+		// with a pixel buffer bound the upload is queued and the data pointer is an offset into it
+		glTexSubImage2D( GL_TEXTURE_2D, 0, 0, 0, vp_width, vp_height, GL_RGBA, GL_UNSIGNED_BYTE, BUFFER_OFFSET(0) );
+	}
+	glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
 
-			// to ensure a power-of-two texture, get the next highest power of two
-			// https://graphics.stanford.edu/~seander/bithacks.html#RoundUpPowerOf2
-			unsigned int v; // compute the next highest power of 2 of 32-bit v
-			v = vp_width;
-			v--;
-			v |= v >> 1;
-			v |= v >> 2;
-			v |= v >> 4;
-			v |= v >> 8;
-			v |= v >> 16;
-			v++;
-			
-			glTexImage1D( GL_TEXTURE_1D, 0, GL_RGB, v, 0, GL_RGB, GL_FLOAT, texture );
-			vertices[0] = point3(0, y, 0);
-			vertices[1] = point3(v, y, 1);
-			glBufferSubData( GL_ARRAY_BUFFER, 0, 2 * sizeof(point3), vertices);
+	pbo_index = 1 - pbo_index;
+	framebuffer_dirty = false;
+}
+
+// cancel the frame being traced, if any, and start a new one on the next refresh
+void restartFrame() {
+	if (render->running) {
+		cancelRender(*render);
+		cancelled_renders.push_back(std::move(render));
+		render.reset(new Render());
+	}
+	start_frame = true;
+}
+
+void display( void ) {
+	// cancelled frames are freed once the tiles they were tracing are done
+	for (size_t i = 0; i < cancelled_renders.size(); i++) {
+		if (renderIdle(*cancelled_renders[i])) {
+			finishRender(*cancelled_renders[i]);
+			cancelled_renders.erase(cancelled_renders.begin() + i--);
 		}
+	}
 
-		glDrawArrays( GL_LINES, 0, 2 );
-		
-		glFlush();
-		glFinish();
-		glutSwapBuffers();
-		
-		drawing_y += 0.5;
+	// start tracing a new frame in the background, the window shows each pass of its tiles as they finish
+	if (start_frame && !render->running) {
+		resetRayStats();
+		startRender(*render, vp_width, vp_height, true);
+		framebuffer.assign(size_t(vp_width) * vp_height, packColour(background_colour));
+		tile_passes.assign(render->tilesX * render->tilesY, 0);
+		framebuffer_dirty = true;
+		start_frame = false;
 	}
+
+	if (render->running) {
+		bool finished = renderDone(*render);
+		collectTiles();
+
+		// the render's tasks are all done, so this does not wait
+		if (finished) {
+			finishRender(*render);
+			std::cout << "Frame done in " << render->seconds << "s on " << workerCount() << " threads\n";
+
+			long long lookups, hits;
+			occluderCacheStats(lookups, hits);
+			std::cout << "Shadow occluder cache hits: " << hits << " of " << lookups << " lookups\n";
+
+			long long rays, culled;
+			rayStats(rays, culled);
+			std::cout << "Rays traced: " << rays << ", culled for contributing too little: " << culled << "\n";
+			std::cout << "Samples per pixel: " << samplesPerPixel(*render) << "\n";
+		}
+	}
+
+	if (framebuffer_dirty && !framebuffer.empty()) {
+		uploadFrame();
+	}
+
+	glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
+	glDrawArrays( GL_TRIANGLE_STRIP, 0, 4 );
+	glutSwapBuffers();
 }
 
 //----------------------------------------------------------------------------
@@ -143,7 +211,7 @@ void keyboard( unsigned char key, int x, int y ) {
 		exit( EXIT_SUCCESS );
 		break;
 	case ' ':
-		drawing_y = 1;
+		restartFrame();
 		break;
 	}
 }
@@ -182,8 +250,17 @@ void reshape( int width, int height ) {
 	// GLfloat aspect = GLfloat(width)/height;
 	// glm::mat4  projection = glm::ortho( -aspect, aspect, -1.0f, 1.0f, -1.0f, 1.0f );
 	// glUniformMatrix4fv( Projection, 1, GL_FALSE, glm::value_ptr(projection) );
+	restartFrame();
 	vp_width = width;
 	vp_height = height;
-	glUniform2f( Window, width, height );
-	drawing_y = 0;
+
+	// resize the texture and the pixel buffers to the window
+	glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL );
+	for (int i = 0; i < 2; i++) {
+		glBindBuffer( GL_PIXEL_UNPACK_BUFFER, pbos[i] );
+		glBufferData( GL_PIXEL_UNPACK_BUFFER, GLsizeiptr(width) * height * 4, NULL, GL_STREAM_DRAW );
+	}
+	glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+
+	framebuffer.clear();
 }
@@ -4,13 +4,74 @@
 */
 
 #include "raytracer.h"
+#include "bvhcache.h"
+#include "renderer.h"
+#include "scenefile.h"
+#include "tasks.h"
+#include "wavefront.h"
+
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <random>
+
+#include <sys/stat.h>
 
 const char *PATH = "scenes/";
 
 double fov = 60;
 colour3 background_colour(0, 0, 0);
+bool useOccluderCache = true;
+int packetSize = 0;
+// not exact: the culled rays' share of a colour can still round a pixel to the next 1/255
+float minContribution = 1.0f / 512.0f;
+bool russianRoulette = false;
+
+// below this contribution, russian roulette keeps a ray with probability contribution / ROULETTE_START
+const float ROULETTE_START = 0.1f;
+
+Scene scene;
+
+// State kept by each tracing thread. The occluder cache holds the primitive that last blocked
+// each light's shadow rays; neighbouring pixels tend to be shadowed by the same object, so it
+// is tested before the BVH.
+struct ThreadState {
+	std::vector<int> lastOccluder;
+	std::atomic<long long> lookups;
+	std::atomic<long long> hits;
+	std::atomic<long long> rays; // rays intersected with the scene
+	std::atomic<long long> culled; // reflected and refracted rays dropped for contributing too little
+	std::minstd_rand random;
+
+	ThreadState() : lookups(0), hits(0), rays(0), culled(0) {}
+};
+
+// every thread's state, so the counters can be summed; the states are freed at exit
+static std::mutex threadStatesMutex;
+static std::vector<std::unique_ptr<ThreadState>> threadStates;
+
+// counter sums at the last resetRayStats(), subtracted from the reported sums; the owning
+// threads are never made to zero their counters, so a reset cannot race with their bumps
+static long long baseLookups = 0, baseHits = 0, baseRays = 0, baseCulled = 0;
+
+static ThreadState &threadState() {
+	thread_local ThreadState *state = NULL;
+	if (state == NULL) {
+		std::lock_guard<std::mutex> lock(threadStatesMutex);
+		threadStates.emplace_back(new ThreadState());
+		state = threadStates.back().get();
+	}
+
+	return *state;
+}
 
-json scene;
+// only the owning thread writes its counters, so they are bumped without a read-modify-write
+static void bump(std::atomic<long long> &counter, long long amount = 1) {
+	counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
 
 /****************************************************************************/
 
@@ -28,10 +89,6 @@ json find(json &j, const std::string key, const std::string value) {
 	return json();
 }
 
-glm::vec3 vector_to_vec3(const std::vector<float> &v) {
-	return glm::vec3(v[0], v[1], v[2]);
-}
-
 // clamp a vector between 0,0,0 and 1,1,1
 glm::vec3 clamp(glm::vec3 vector) {
 	return glm::clamp(vector, glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(1.0f, 1.0f, 1.0f));
@@ -39,6 +96,48 @@ glm::vec3 clamp(glm::vec3 vector) {
 
 /****************************************************************************/
 
+// true if the file exists and is at least as new as the file it was made from (or that file is missing)
+static bool isUpToDate(const std::string &path, const std::string &sourcePath) {
+	struct stat status, sourceStatus;
+	if (stat(path.c_str(), &status) != 0)
+		return false;
+	return stat(sourcePath.c_str(), &sourceStatus) != 0 || status.st_mtime >= sourceStatus.st_mtime;
+}
+
+/*
+map the BVH of the scene from its cache file, or build it and write the cache file
+	scenePath: file the scene was loaded from, cache files are kept next to it
+*/
+static void loadBVH(const std::string &scenePath) {
+	if (!useBVHCache || scene.spheres.size() + scene.triangles.size() < BVH_CACHE_MIN_PRIMITIVES) {
+		buildBVH(scene, scene.bvh);
+		return;
+	}
+	
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	uint64_t key = bvhCacheKey(scene);
+	std::string cachePath = bvhCachePath(scenePath, key);
+	
+	struct stat status;
+	std::string error;
+	if (stat(cachePath.c_str(), &status) == 0) {
+		if (mapBVHCache(cachePath, key, scene, scene.bvh, error)) {
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			std::cout << "Mapped BVH cache " << cachePath << " in " << seconds << "s\n";
+			return;
+		}
+		std::cout << "Ignoring BVH cache " << cachePath << ": " << error << std::endl;
+	}
+	
+	buildBVH(scene, scene.bvh);
+	if (writeBVHCache(cachePath, key, scene.bvh)) {
+		std::cout << "Wrote BVH cache " << cachePath << std::endl;
+	}
+	else {
+		std::cout << "Unable to write BVH cache " << cachePath << std::endl;
+	}
+}
+
 void choose_scene(char const *fn) {
 	if (fn == NULL) {
 		std::cout << "Using default input file " << PATH << "c.json\n";
@@ -46,15 +145,38 @@ void choose_scene(char const *fn) {
 	}
 	
 	std::string fname = PATH + std::string(fn) + ".json";
-	std::fstream in(fname);
-	if (!in.is_open()) {
-		std::cout << "Unable to open scene file " << fname << std::endl;
-		exit(EXIT_FAILURE);
+	std::string binaryName = PATH + std::string(fn) + ".scene";
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	json j;
+	std::string error;
+	
+	// a binary scene made by scenetool is mapped and used in place, unless the JSON has been edited since
+	bool mapped = false;
+	if (isUpToDate(binaryName, fname)) {
+		mapped = mapSceneFile(binaryName, scene, j, error);
+		if (!mapped) {
+			std::cout << "Ignoring scene file " << binaryName << ": " << error << std::endl;
+		}
 	}
 	
-	in >> scene;
+	if (!mapped) {
+		std::fstream in(fname);
+		if (!in.is_open()) {
+			std::cout << "Unable to open scene file " << fname << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		
+		// the scene is streamed into the compiled arrays as it is read, without a DOM of the whole file
+		if (!loadScene(in, PATH, j, scene, error)) {
+			std::cout << "Unable to read scene file " << fname << ": " << error << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cout << (mapped ? "Mapped " : "Read ") << (mapped ? binaryName : fname) << " in " << seconds << "s, peak memory "
+		<< peakMemoryBytes() / (1024.0 * 1024.0) << " MB\n";
 	
-	json camera = scene["camera"];
+	json camera = j["camera"];
 	// these are optional parameters (otherwise they default to the values initialized earlier)
 	if (camera.find("field") != camera.end()) {
 		fov = camera["field"];
@@ -64,10 +186,132 @@ void choose_scene(char const *fn) {
 		background_colour = vector_to_vec3(camera["background"]);
 		std::cout << "Setting background colour to " << glm::to_string(background_colour) << std::endl;
 	}
+
+	// the json is not used after this point, everything is traced against the compiled scene
+	loadBVH(mapped ? binaryName : fname);
+}
+
+/*
+apply a command line option of the form --name=value, returns false if the option is not recognized
+	arg: the command line argument
+*/
+bool parseOption(const std::string &arg) {
+	size_t equals = arg.find('=');
+	std::string name = arg.substr(0, equals);
+	std::string value = equals == std::string::npos ? "" : arg.substr(equals + 1);
+
+	if (name == "--bvh-width" && (value == "2" || value == "4" || value == "8")) {
+		bvhWidth = std::stoi(value);
+		return true;
+	}
+	if (name == "--triangle-blocks" && (value == "on" || value == "off")) {
+		useTriangleBlocks = value == "on";
+		return true;
+	}
+	if (name == "--occluder-cache" && (value == "on" || value == "off")) {
+		useOccluderCache = value == "on";
+		return true;
+	}
+	if (name == "--bvh-cache" && (value == "on" || value == "off")) {
+		useBVHCache = value == "on";
+		return true;
+	}
+	if (name == "--bvh-builder" && (value == "sweep" || value == "binned")) {
+		bvhBuilder = value == "sweep" ? SWEEP_SAH_BUILDER : BINNED_SAH_BUILDER;
+		return true;
+	}
+	if (name == "--packets" && (value == "off" || value == "4" || value == "8")) {
+		packetSize = value == "off" ? 0 : std::stoi(value);
+		return true;
+	}
+	if (name == "--min-contribution") {
+		char *end;
+		float threshold = std::strtof(value.c_str(), &end);
+		if (value.empty() || *end != 0 || threshold < 0)
+			return false;
+
+		minContribution = threshold;
+		return true;
+	}
+	if (name == "--russian-roulette" && (value == "on" || value == "off")) {
+		russianRoulette = value == "on";
+		return true;
+	}
+	if (name == "--threads" || name == "--tile-size") {
+		char *end;
+		long count = std::strtol(value.c_str(), &end, 10);
+		if (value.empty() || *end != 0 || count < (name == "--threads" ? 0 : 1) || count > 4096)
+			return false;
+
+		if (name == "--threads") {
+			setWorkerCount(int(count));
+		}
+		else {
+			tileSize = int(count);
+		}
+		return true;
+	}
+	if (name == "--aa-samples") {
+		char *end;
+		long samples = std::strtol(value.c_str(), &end, 10);
+		if (value.empty() || *end != 0 || samples < 1 || samples > MAX_AA_SAMPLES)
+			return false;
+
+		aaSamples = int(samples);
+		return true;
+	}
+	if (name == "--aa-threshold") {
+		char *end;
+		float threshold = std::strtof(value.c_str(), &end);
+		if (value.empty() || *end != 0 || threshold < 0)
+			return false;
+
+		aaThreshold = threshold;
+		return true;
+	}
+	if (name == "--pixel-format" && (value == "float" || value == "half")) {
+		pixelFormat = value == "float" ? PIXELS_FLOAT : PIXELS_HALF;
+		return true;
+	}
+	if (name == "--progressive" && (value == "on" || value == "off")) {
+		progressive = value == "on";
+		return true;
+	}
+	if (name == "--wavefront" && (value == "off" || value == "on" || value == "sorted")) {
+		wavefrontMode = value == "off" ? WAVEFRONT_OFF : value == "on" ? WAVEFRONT_ON : WAVEFRONT_SORTED;
+		return true;
+	}
+
+	return false;
 }
 
 bool trace(const point3 &e, const point3 &s, colour3 &colour, bool pick) {
-	return castRay(e, s, colour, -1.0, 8);
+	return castRay(e, s, colour, -1.0, MAX_RAY_DEPTH);
+}
+
+/*
+trace a packet of primary rays that share an origin, finding their first hits together
+(secondary rays are traced one at a time)
+	e: shared start point of the rays
+	s: intersection point of each ray
+	count: number of rays, at most MAX_PACKET_RAYS
+	colours: output colour of each ray
+	primitives: output primitive each ray hit first, -1 if it hit nothing
+*/
+void tracePacket(const point3 &e, const point3 *s, int count, colour3 *colours, int *primitives) {
+	Hit packetHits[MAX_PACKET_RAYS];
+	bool found[MAX_PACKET_RAYS];
+	intersectPacket(e, s, count, packetHits, found);
+
+	countRays(count, 0);
+
+	for (int i = 0; i < count; i++) {
+		primitives[i] = found[i] ? packetHits[i].primitive : -1;
+
+		if (found[i]) {
+			shade(e, s[i], packetHits[i], colours[i], -1.0, MAX_RAY_DEPTH);
+		}
+	}
 }
 
 /*
@@ -76,417 +320,994 @@ cast a ray in the scene
 	s: intersection point of the ray
 	colour: output colour of casted ray (supports all features)
 	ni: current index of refraction (if -1.0, ni is by default 1.0)
-	iterations: # of iterations left (stop recursion when iterations = 0)
+	iterations: # of iterations left (stop when iterations = 0)
 */
 bool castRay(const point3 &e, const point3 &s, colour3 &colour, float ni, int iterations) {
-	if (iterations == 0) {
+	if (iterations <= 0) {
 		return false;
 	}
 
-	json object;
+	Hit hit;
+	bump(threadState().rays);
+
+	// find closest intersection in the scene and get the normal and material at intersection
+	if (!intersect(e, s, hit))
+		return false;
+
+	shade(e, s, hit, colour, ni, iterations);
+	return true;
+}
+
+// how a ray's colour is combined into the colour of the ray that spawned it
+enum SpawnedRay { REFLECTED_RAY, TRANSMITTED_RAY, INTERNAL_RAY };
+
+// A ray being shaded by shade(), waiting for the rays it spawns
+struct RayFrame {
+	point3 e, s, p;
 	glm::vec3 n;
-	float t;
+	const Material *material;
+	float ni;
+	int iterations;
+	glm::vec3 weight; // how much the ray contributes to the pixel (product of km and kt along the path)
+	colour3 colour;
+	int stage; // 0 before reflecting, 1 before transmitting, 2 when finished
+	SpawnedRay spawned; // how the parent combines this ray
+	float scale; // compensates the rays russian roulette dropped
+};
+
+// light the hit of a ray and get it ready to spawn rays
+static void startFrame(RayFrame &frame, const point3 &e, const point3 &s, const Hit &hit, float ni, int iterations, const glm::vec3 &weight) {
+	frame.e = e;
+	frame.s = s;
+	frame.p = e + (s - e) * hit.t;
+	frame.n = hit.normal;
+	frame.material = &scene.materials[hit.material];
+	frame.ni = ni;
+	frame.iterations = iterations;
+	frame.weight = weight;
+	frame.stage = 0;
+	frame.spawned = REFLECTED_RAY;
+	frame.scale = 1.0f;
+
+	// light the point of intersection
+	frame.colour = clamp(light(e, frame.p, frame.n, *frame.material));
+}
+
+// combine the colour seen along a spawned ray into the colour of the ray that spawned it
+static void combineRay(RayFrame &frame, SpawnedRay spawned, const colour3 &seen) {
+	if (spawned == REFLECTED_RAY) {
+		frame.colour = clamp(frame.colour + seen * frame.material->reflective);
+	}
+	else if (spawned == TRANSMITTED_RAY) {
+		glm::vec3 kt = frame.material->transmissive;
+		frame.colour = clamp((1.0f - kt) * frame.colour + seen * kt);
+	}
+	else {
+		frame.colour = clamp(frame.colour + seen);
+	}
+}
+
+/*
+spawn a reflected or transmitted ray, pushing a frame for it if it hits something
+	stack, top: frames being shaded, top is incremented when a frame is pushed
+	e: start point of the ray
+	s: intersection point of the ray
+	ni: index of refraction the ray travels in
+	iterations: # of iterations left
+	weight: contribution of the ray to the pixel
+	spawned: how the parent combines the ray
+	seen: output colour seen along the ray when no frame was pushed
+*/
+static bool spawnRay(RayFrame *stack, int &top, const point3 &e, const point3 &s, float ni, int iterations, glm::vec3 weight, SpawnedRay spawned, colour3 &seen) {
+	if (iterations <= 0) {
+		seen = background_colour;
+		return false;
+	}
 
-	// find closest intersection in the scene and get the normal and object at intersection
-	t = intersect(e, s, n, object);
+	ThreadState &state = threadState();
+	float contribution = glm::max(weight.x, glm::max(weight.y, weight.z));
+	float scale = 1.0f;
 
-	if (t < 0)
+	// a ray that can barely change the pixel shows the background, as if it ran out of iterations
+	if (contribution < minContribution) {
+		bump(state.culled);
+		seen = background_colour;
 		return false;
+	}
 
-	point3 p = e + (s - e) * t;
-	json material = object["material"];
+	// otherwise weak rays are kept at random, and the ones kept count for the ones dropped
+	if (russianRoulette && contribution < ROULETTE_START) {
+		float keep = contribution / ROULETTE_START;
 
-	// light the point of intersection
-	colour = light(e, p, n, material);
-	colour = clamp(colour);
+		if (std::uniform_real_distribution<float>(0.0f, 1.0f)(state.random) >= keep) {
+			bump(state.culled);
+			seen = colour3(0.0f, 0.0f, 0.0f);
+			return false;
+		}
+
+		scale = 1.0f / keep;
+		weight *= scale;
+	}
+
+	Hit hit;
+	bump(state.rays);
 
-	// if object has a reflative property, reflect the ray and update color
-	if (material.find("reflective") != material.end()) {
-		reflect(e, p, n, vector_to_vec3(material["reflective"]), colour, iterations);
+	if (!intersect(e, s, hit)) {
+		seen = background_colour * scale;
+		return false;
 	}
 
-	// if object has transmissive property...
-	if (material.find("transmissive") != material.end()) {
-		glm::vec3 kt = vector_to_vec3(material["transmissive"]);
+	top++;
+	startFrame(stack[top], e, s, hit, ni, iterations, weight);
+	stack[top].spawned = spawned;
+	stack[top].scale = scale;
+	return true;
+}
+
+/*
+find the colour of a ray from its closest hit, following reflected and refracted rays with an
+explicit stack and dropping the ones that contribute less than minContribution
+	e: start point of the ray
+	s: intersection point of the ray
+	hit: closest hit of the ray
+	colour: output colour
+	ni: current index of refraction (if -1.0, ni is by default 1.0)
+	iterations: # of iterations left
+*/
+void shade(const point3 &e, const point3 &s, const Hit &hit, colour3 &colour, float ni, int iterations) {
+	// each spawned ray has one iteration less than its parent, so this is as deep as the stack gets
+	RayFrame stack[MAX_RAY_DEPTH];
+	int top = 0;
+
+	startFrame(stack[0], e, s, hit, ni, glm::min(iterations, MAX_RAY_DEPTH), glm::vec3(1.0f, 1.0f, 1.0f));
+
+	while (true) {
+		RayFrame &frame = stack[top];
+		const Material &material = *frame.material;
+		colour3 seen;
+
+		// if object has a reflective property, reflect the ray
+		if (frame.stage == 0) {
+			frame.stage = 1;
+
+			if (material.hasReflective) {
+				point3 r = frame.p + reflectDirection(frame.e, frame.p, frame.n);
 
-		// if object has refraction proprty, refract the ray. otherwise, perform simple transparent ray
-		if (material.find("refraction") != material.end()) {
-			refract(p, e, s, n, colour, ni, kt, material["refraction"], iterations);
+				if (!spawnRay(stack, top, frame.p, r, -1.0f, frame.iterations - 1, frame.weight * material.reflective, REFLECTED_RAY, seen)) {
+					combineRay(frame, REFLECTED_RAY, seen);
+				}
+			}
+			continue;
 		}
-		else {
-			transparentRay(p, s - e, colour, kt, iterations);
+
+		// if object has transmissive property, refract the ray or cast a simple transparent ray
+		if (frame.stage == 1) {
+			frame.stage = 2;
+
+			if (material.hasTransmissive) {
+				glm::vec3 kt = material.transmissive;
+				SpawnedRay spawned = TRANSMITTED_RAY;
+				point3 t = frame.p + (frame.s - frame.e);
+				float nextNi = -1.0f;
+				int iterations = frame.iterations - 1;
+
+				if (material.hasRefraction) {
+					glm::vec3 vr;
+
+					if (refractDirection(frame.e, frame.s, frame.n, frame.ni, material.refraction, vr, nextNi)) {
+						t = frame.p + vr;
+					}
+					else {
+						// total internal reflection, added to the colour with one iteration less
+						spawned = INTERNAL_RAY;
+						t = frame.p + reflectDirection(frame.e, frame.p, frame.n);
+						nextNi = -1.0f;
+						kt = glm::vec3(1.0f, 1.0f, 1.0f);
+						iterations--;
+					}
+				}
+
+				if (!spawnRay(stack, top, frame.p, t, nextNi, iterations, frame.weight * kt, spawned, seen)) {
+					combineRay(frame, spawned, seen);
+				}
+			}
+			continue;
 		}
+
+		if (top == 0)
+			break;
+
+		// the ray is finished, hand its colour to the ray that spawned it
+		seen = clamp(frame.colour) * frame.scale;
+		SpawnedRay spawned = frame.spawned;
+		top--;
+		combineRay(stack[top], spawned, seen);
 	}
 
-	return true;
+	colour = stack[0].colour;
 }
 
+// the scene's own tree, which is first in every node array
+static const BVHRoot SCENE_ROOT = { 0, 0, 0 };
+
+template <bool ANY_HIT>
+static bool intersectBVH(const point3 &e, const point3 &s, const glm::vec3 &invD, float &tMin, int &closest, const BVHRoot &root);
+
 /*
-find closest intersection in the scene, return -1 if no intersection
+intersect an instance by moving the ray into object space and tracing it through the
+tree of the instance's mesh; t along the ray is the same in both spaces
+	ANY_HIT: stop at the first hit instead of looking for the closest
+	instance: instance
 	e: origin of ray
 	s: intersection of ray
-	normal: output normal at intersection
-	object: output object at intersection
+	tMin: t value of the closest hit so far, updated
+	triangle: output primitive id of the mesh triangle that was hit
+	returns true if anything closer than tMin was hit
 */
-float intersect(point3 e, point3 s, glm::vec3 &normal, json &object) {
-	bool hit = false;
-	float minT = -1.0f;
+template <bool ANY_HIT>
+static inline bool intersectInstance(const Instance &instance, const point3 &e, const point3 &s, float &tMin, int &triangle) {
+	point3 objectE = instance.toObject * e + instance.toObjectOffset;
+	point3 objectS = instance.toObject * s + instance.toObjectOffset;
+	glm::vec3 invD = 1.0f / (objectS - objectE);
+	return intersectBVH<ANY_HIT>(objectE, objectS, invD, tMin, triangle, scene.bvh.meshRoots[instance.mesh]);
+}
+
+/*
+intersect the primitives of a BVH leaf, keeping the closest hit
+	ANY_HIT: stop at the first hit instead of looking for the closest
+	e: origin of ray
+	s: intersection of ray
+	offset, count: range of the leaf in the BVH primitive list
+	tMin: t value of the closest hit so far, updated
+	closest: primitive id of the closest hit so far, updated (an instance rather than its triangle)
+	returns true if anything closer than tMin was hit
+*/
+template <bool ANY_HIT>
+static inline bool intersectLeaf(const point3 &e, const point3 &s, int offset, int count, float &tMin, int &closest) {
 	float safeT = 0.001f;
+	float currT;
+	bool found = false;
+	int i = offset;
+	int firstTriangle = int(scene.spheres.size() + scene.planes.size());
+	int firstInstance = firstTriangle + int(scene.triangles.size());
+
+	// the leaf's triangles come first, in whole blocks
+	if (useTriangleBlocks) {
+		glm::vec3 d = s - e;
+		int lane;
 
-	// for all objects in the scene
-	json &objects = scene["objects"];
-	for (json::iterator it = objects.begin(); it != objects.end(); ++it) {
-		json &currObject = *it;
-		float currT;
-
-		if (currObject["type"] == "sphere") {
-			point3 c = vector_to_vec3(currObject["position"]);
-			float R = float(currObject["radius"]);
-
-			if (raySphereIntersection(e, s, c, R, currT) && currT > safeT && (currT < minT || !hit)) {
-				hit = true;
-				minT = currT;
-				object = currObject;
-				
-				// getting sphere normal
-				point3 p = e + (s - e) * currT;
-				normal = glm::normalize(p - c);
+		for (; i < offset + count; i += TRIANGLE_BLOCK_SIZE) {
+			int primitive = scene.bvh.primitives[i];
+			if (primitive >= 0 && (primitive < firstTriangle || primitive >= firstInstance))
+				break;
 
-				continue;
+			const TriangleBlock &block = scene.bvh.blocks[i / TRIANGLE_BLOCK_SIZE];
+			if (rayTriangleBlockIntersection(block, e, d, safeT, tMin, currT, lane)) {
+				tMin = currT;
+				closest = block.primitive[lane];
+				found = true;
+
+				if (ANY_HIT)
+					return true;
 			}
 		}
+	}
 
-		if (currObject["type"] == "plane") {
-			point3 a = vector_to_vec3(currObject["position"]);
-			glm::vec3 n = glm::normalize(vector_to_vec3(currObject["normal"]));
+	for (; i < offset + count; i++) {
+		int primitive = scene.bvh.primitives[i];
+		if (primitive < 0)
+			continue;
 
-			if (rayPlaneIntersection(e, s, a, n, currT) && currT > safeT && (currT < minT || !hit)) {
-				hit = true;
-				minT = currT;
-				object = currObject;
-				normal = n;
-				continue;
+		if (primitive >= firstInstance) {
+			int triangle;
+			if (intersectInstance<ANY_HIT>(scene.instances[primitive - firstInstance], e, s, tMin, triangle)) {
+				closest = primitive;
+				found = true;
+
+				if (ANY_HIT)
+					return true;
 			}
+			continue;
 		}
 
-		if (currObject["type"] == "mesh") {
-			std::vector<std::vector<std::vector<float>>> triangles = currObject["triangles"];
-
-			for (int i = 0; i < triangles.size(); i++) {
-				std::vector<std::vector<float>> triangle = triangles[i];
-				point3 a = vector_to_vec3(triangle[0]);
-				point3 b = vector_to_vec3(triangle[1]);
-				point3 c = vector_to_vec3(triangle[2]);
-				glm::vec3 n = glm::normalize(glm::cross(b - a, c - b));
+		if (intersectPrimitive(e, s, primitive, currT) && currT > safeT && currT < tMin) {
+			tMin = currT;
+			closest = primitive;
+			found = true;
 
-				if (rayTriangleIntersection(e, s, a, b, c, n, currT) && currT > safeT && (currT < minT || !hit)) {
-					hit = true;
-					minT = currT;
-					object = currObject;
-					normal = n;
-					continue;
-				}
-			}
+			if (ANY_HIT)
+				return true;
 		}
 	}
 
-	return minT;
+	return found;
 }
 
 /*
-light ponit of intersection
-	e: origin of ray (eye position initially)
-	p: point of intersection
-	n: normal at point of intersection
-	material: material properties of object at point of intersection
+find the closest hit in a binary tree of the BVH
+	ANY_HIT: return at the first hit instead of looking for the closest
+	e: origin of ray
+	s: intersection of ray
+	invD: 1 / (s - e), per component
+	tMin: t value of the closest hit so far, updated
+	closest: primitive id of the closest hit so far, updated
+	root: node the tree starts at
+	returns true if anything closer than tMin was hit
 */
-colour3 light(point3 e, point3 p, glm::vec3 n, json material) {
-	colour3 color = colour3(0, 0, 0);
-	json &lights = scene["lights"];
+template <bool ANY_HIT>
+static bool intersectBinary(const point3 &e, const point3 &s, const glm::vec3 &invD, float &tMin, int &closest, int root) {
+	const MappedArray<BVHNode> &nodes = scene.bvh.nodes;
+	float tNear;
+	bool found = false;
 
-	n = glm::normalize(n);
-	glm::vec3 v = glm::normalize(e - p);
+	if (nodes.empty() || !rayBoxIntersection(e, invD, nodes[root].bounds, tMin, tNear))
+		return false;
 
-	// for all lights in the scene...
-	for (json::iterator it = lights.begin(); it != lights.end(); ++it) {
-		json &light = *it;
+	int stack[BVH_MAX_DEPTH + 2];
+	int top = 0;
+	stack[top++] = root;
 
-		if (light["type"] == "ambient" && material.find("diffuse") != material.end()) {
-			colour3 ia = vector_to_vec3(light["color"]);
-			colour3 ka = vector_to_vec3(material["ambient"]);
-			color += ia * ka;
-			color = clamp(color);
+	while (top > 0) {
+		const BVHNode &node = nodes[stack[--top]];
 
+		if (node.count > 0) {
+			if (intersectLeaf<ANY_HIT>(e, s, node.offset, node.count, tMin, closest)) {
+				found = true;
+				if (ANY_HIT)
+					return true;
+			}
 			continue;
 		}
 
-		if (light["type"] == "directional") {
-			glm::vec3 direction = vector_to_vec3(light["direction"]);
-			glm::vec3 l = glm::normalize(-direction);
+		// visit the nearer child first so its hits can cull the farther one
+		float tLeft, tRight;
+		bool hitLeft = rayBoxIntersection(e, invD, nodes[node.offset].bounds, tMin, tLeft);
+		bool hitRight = rayBoxIntersection(e, invD, nodes[node.offset + 1].bounds, tMin, tRight);
 
-			// dont light it if light doesnt reach it
-			if (pointInShadow(p, p + (l * 100.0f))) {
+		if (hitLeft && hitRight) {
+			if (tLeft <= tRight) {
+				stack[top++] = node.offset + 1;
+				stack[top++] = node.offset;
+			}
+			else {
+				stack[top++] = node.offset;
+				stack[top++] = node.offset + 1;
+			}
+		}
+		else if (hitLeft) {
+			stack[top++] = node.offset;
+		}
+		else if (hitRight) {
+			stack[top++] = node.offset + 1;
+		}
+	}
+
+	return found;
+}
+
+/*
+find the closest hit in a wide tree of the BVH
+	ANY_HIT: return at the first hit instead of looking for the closest
+	nodes: 4 or 8 wide nodes
+	e: origin of ray
+	s: intersection of ray
+	invD: 1 / (s - e), per component
+	tMin: t value of the closest hit so far, updated
+	closest: primitive id of the closest hit so far, updated
+	root: node the tree starts at
+	returns true if anything closer than tMin was hit
+*/
+template <bool ANY_HIT, int W>
+static bool intersectWide(const MappedArray<WideBVHNode<W>> &nodes, const point3 &e, const point3 &s, const glm::vec3 &invD, float &tMin, int &closest, int root) {
+	int stack[BVH_MAX_DEPTH * W];
+	int top = 0;
+	bool found = false;
+	stack[top++] = root;
+
+	while (top > 0) {
+		const WideBVHNode<W> &node = nodes[stack[--top]];
+		float tNear[W];
+		int mask = rayWideBoxIntersection(node, e, invD, tMin, tNear);
+
+		// leaves are intersected right away, interior children are sorted far to near onto the stack
+		int order[W];
+		int interior = 0;
+
+		for (int i = 0; i < W; i++) {
+			if (!(mask & (1 << i)))
+				continue;
+
+			if (node.count[i] > 0) {
+				if (intersectLeaf<ANY_HIT>(e, s, node.offset[i], node.count[i], tMin, closest)) {
+					found = true;
+					if (ANY_HIT)
+						return true;
+				}
 				continue;
 			}
 
-			// diffuse
-			if (material.find("diffuse") != material.end()) {
-				colour3 id = vector_to_vec3(light["color"]);
-				colour3 kd = vector_to_vec3(material["diffuse"]);
-				float dotP = glm::dot(n, l);
-				if (dotP < 0.0f) dotP = 0.0f;
-				color += id * kd * dotP;
-				color = clamp(color);
+			int j = interior++;
+			while (j > 0 && tNear[order[j - 1]] < tNear[i]) {
+				order[j] = order[j - 1];
+				j--;
 			}
+			order[j] = i;
+		}
 
-			// specular if material supports specular component
-			if (material.find("specular") != material.end()) {
-				colour3 is = vector_to_vec3(light["color"]);
-				colour3 ks = vector_to_vec3(material["specular"]);
-				float alpha = material["shininess"];
-				glm::vec3 h = glm::normalize(l + v);
+		for (int i = 0; i < interior; i++) {
+			stack[top++] = node.offset[order[i]];
+		}
+	}
 
-				float dotP = glm::dot(n, h);
-				if (dotP < 0.0f) dotP = 0.0f;
-				color += is * ks * std::pow(dotP, alpha);
-				color = clamp(color);
-			}
+	return found;
+}
 
-			continue;
+/*
+find the closest hit in a tree of whichever BVH is selected by bvhWidth
+	ANY_HIT: return at the first hit instead of looking for the closest
+	root: the scene's tree (SCENE_ROOT) or the tree of an instanced mesh
+	(other parameters as for intersectBinary)
+*/
+template <bool ANY_HIT>
+static bool intersectBVH(const point3 &e, const point3 &s, const glm::vec3 &invD, float &tMin, int &closest, const BVHRoot &root) {
+	if (bvhWidth == 4 && !scene.bvh.nodes4.empty() && root.node4 >= 0) {
+		return intersectWide<ANY_HIT>(scene.bvh.nodes4, e, s, invD, tMin, closest, root.node4);
+	}
+	if (bvhWidth == 8 && !scene.bvh.nodes8.empty() && root.node8 >= 0) {
+		return intersectWide<ANY_HIT>(scene.bvh.nodes8, e, s, invD, tMin, closest, root.node8);
+	}
+	return intersectBinary<ANY_HIT>(e, s, invD, tMin, closest, root.node);
+}
+
+/*
+find closest intersection in the scene, return false if no intersection
+	e: origin of ray
+	s: intersection of ray
+	hit: output t, normal, primitive and material at intersection
+*/
+bool intersect(const point3 &e, const point3 &s, Hit &hit) {
+	float safeT = 0.001f;
+	float currT;
+	int closest = -1;
+
+	hit.t = FLT_MAX;
+
+	// planes are unbounded so they are not in the BVH
+	for (size_t i = 0; i < scene.planes.size(); i++) {
+		const Plane &plane = scene.planes[i];
+
+		if (rayPlaneIntersection(e, s, plane.a, plane.n, currT) && currT > safeT && currT < hit.t) {
+			hit.t = currT;
+			closest = int(scene.spheres.size() + i);
 		}
+	}
 
-		if (light["type"] == "point") {
-			point3 lightPosition = vector_to_vec3(light["position"]);
-			glm::vec3 l = glm::normalize(lightPosition - p);
+	glm::vec3 invD = 1.0f / (s - e);
+	intersectBVH<false>(e, s, invD, hit.t, closest, SCENE_ROOT);
 
-			// dont add color if light doesnt reach the point
-			if (pointInShadow(p, lightPosition)) {
-				continue;
-			}
+	if (closest < 0)
+		return false;
 
-			// diffuse
-			if (material.find("diffuse") != material.end()) {
-				glm::vec3 id = vector_to_vec3(light["color"]);
-				colour3 kd = vector_to_vec3(material["diffuse"]);
-				float dotP = glm::dot(n, l);
-				if (dotP < 0.0f) dotP = 0.0f;
-				color += id * kd * dotP;
-				color = clamp(color);
+	// only the closest primitive needs its normal and material looked up
+	hit.primitive = closest;
+	hitNormal(e, s, hit);
+	return true;
+}
+
+/*
+find the closest hit of every ray in a packet of rays that share an origin, traversing the
+binary BVH with the whole packet and culling nodes with interval arithmetic on the ray directions
+	e: shared origin of the rays
+	s: intersection point of each ray
+	count: number of rays, at most MAX_PACKET_RAYS
+	hits: output closest hit of each ray
+	found: output whether each ray hit anything
+*/
+void intersectPacket(const point3 &e, const point3 *s, int count, Hit *hits, bool *found) {
+	float safeT = 0.001f;
+	float currT;
+	glm::vec3 invD[MAX_PACKET_RAYS];
+	int closest[MAX_PACKET_RAYS];
+
+	// range of each inverse direction component over the packet; an axis whose rays do not
+	// all point the same way cannot be used for culling
+	glm::vec3 invLow(FLT_MAX), invHigh(-FLT_MAX);
+	bool usable[3] = { true, true, true };
+
+	for (int i = 0; i < count; i++) {
+		glm::vec3 d = s[i] - e;
+		invD[i] = 1.0f / d;
+		invLow = glm::min(invLow, invD[i]);
+		invHigh = glm::max(invHigh, invD[i]);
+		hits[i].t = FLT_MAX;
+		closest[i] = -1;
+
+		for (int axis = 0; axis < 3; axis++) {
+			if (d[axis] == 0 || (s[0][axis] - e[axis] > 0) != (d[axis] > 0)) {
+				usable[axis] = false;
 			}
+		}
 
-			// specular if material supports specular component
-			if (material.find("specular") != material.end()) {
-				colour3 is = vector_to_vec3(light["color"]);
-				colour3 ks = vector_to_vec3(material["specular"]);
-				float alpha = material["shininess"];
-				glm::vec3 h = glm::normalize(l + v);
+		for (size_t p = 0; p < scene.planes.size(); p++) {
+			const Plane &plane = scene.planes[p];
 
-				float dotP = glm::dot(n, h);
-				if (dotP < 0.0f) dotP = 0.0f;
-				color += is * ks * std::pow(dotP, alpha);
-				color = clamp(color);
+			if (rayPlaneIntersection(e, s[i], plane.a, plane.n, currT) && currT > safeT && currT < hits[i].t) {
+				hits[i].t = currT;
+				closest[i] = int(scene.spheres.size() + p);
 			}
-
-			continue;
 		}
+	}
 
-		if (light["type"] == "spot") {
-			point3 lightPosition = vector_to_vec3(light["position"]);
-			glm::vec3 direction = glm::normalize(vector_to_vec3(light["direction"]));
-			glm::vec3 l = glm::normalize(lightPosition - p);
-			float cutoff = light["cutoff"];
+	const MappedArray<BVHNode> &nodes = scene.bvh.nodes;
 
-			// dont calculate light if point is outside the cutoff angle
-			if (glm::dot(l, -direction) < glm::cos(glm::radians(cutoff))) {
-				continue;
-			}
+	// every entry holds a node and the first ray of the packet that can still hit it
+	int stack[BVH_MAX_DEPTH + 2][2];
+	int top = 0;
+	if (!nodes.empty()) {
+		stack[top][0] = 0;
+		stack[top][1] = 0;
+		top++;
+	}
+
+	while (top > 0) {
+		top--;
+		const BVHNode &node = nodes[stack[top][0]];
+		int first = stack[top][1];
+
+		// interval test: the latest any ray could enter the box against the earliest it must leave
+		float tFarthest = 0.0f;
+		for (int i = first; i < count; i++) {
+			tFarthest = glm::max(tFarthest, hits[i].t);
+		}
 
-			// dont add color if light doesnt reach the point
-			if (pointInShadow(p, lightPosition)) {
+		float enter = 0.0f, leave = tFarthest;
+		for (int axis = 0; axis < 3; axis++) {
+			if (!usable[axis])
 				continue;
-			}
 
-			// diffuse
-			if (material.find("diffuse") != material.end()) {
-				glm::vec3 id = vector_to_vec3(light["color"]);
-				colour3 kd = vector_to_vec3(material["diffuse"]);
-				float dotP = glm::dot(n, l);
-				if (dotP < 0.0f) dotP = 0.0f;
-				color += id * kd * dotP;
-				color = clamp(color);
+			bool positive = invLow[axis] > 0;
+			float nearPlane = (positive ? node.bounds.min[axis] : node.bounds.max[axis]) - e[axis];
+			float farPlane = (positive ? node.bounds.max[axis] : node.bounds.min[axis]) - e[axis];
+			enter = glm::max(enter, glm::min(nearPlane * invLow[axis], nearPlane * invHigh[axis]));
+			leave = glm::min(leave, glm::max(farPlane * invLow[axis], farPlane * invHigh[axis]));
+		}
+		if (enter > leave)
+			continue;
+
+		// skip the rays at the start of the packet that miss the box
+		float tNear;
+		while (first < count && !rayBoxIntersection(e, invD[first], node.bounds, hits[first].t, tNear)) {
+			first++;
+		}
+		if (first == count)
+			continue;
+
+		if (node.count > 0) {
+			for (int i = first; i < count; i++) {
+				if (i == first || rayBoxIntersection(e, invD[i], node.bounds, hits[i].t, tNear)) {
+					intersectLeaf<false>(e, s[i], node.offset, node.count, hits[i].t, closest[i]);
+				}
 			}
-			
-			// specular if material supports specular component
-			if (material.find("specular") != material.end()) {
-				colour3 is = vector_to_vec3(light["color"]);
-				colour3 ks = vector_to_vec3(material["specular"]);
-				float alpha = material["shininess"];
-				glm::vec3 h = glm::normalize(l + v);
-
-				float dotP = glm::dot(n, h);
-				if (dotP < 0.0f) dotP = 0.0f;
-				color += is * ks * std::pow(dotP, alpha);
+			continue;
+		}
+
+		// order the children by the first active ray
+		float tLeft, tRight;
+		bool hitLeft = rayBoxIntersection(e, invD[first], nodes[node.offset].bounds, FLT_MAX, tLeft);
+		bool hitRight = rayBoxIntersection(e, invD[first], nodes[node.offset + 1].bounds, FLT_MAX, tRight);
+		int nearChild = node.offset, farChild = node.offset + 1;
+		if (hitRight && (!hitLeft || tRight < tLeft)) {
+			std::swap(nearChild, farChild);
+		}
+
+		stack[top][0] = farChild;
+		stack[top][1] = first;
+		top++;
+		stack[top][0] = nearChild;
+		stack[top][1] = first;
+		top++;
+	}
+
+	for (int i = 0; i < count; i++) {
+		found[i] = closest[i] >= 0;
+
+		if (found[i]) {
+			hits[i].primitive = closest[i];
+			hitNormal(e, s[i], hits[i]);
+		}
+	}
+}
+
+/*
+check if anything blocks a ray before it reaches tMax, stopping at the first blocker
+	e: origin of ray
+	s: intersection of ray
+	tMax: t value where the ray ends (1 for the segment from e to s)
+*/
+bool occluded(const point3 &e, const point3 &s, float tMax, int &blocker) {
+	float safeT = 0.001f;
+	float currT;
+
+	for (size_t i = 0; i < scene.planes.size(); i++) {
+		const Plane &plane = scene.planes[i];
+
+		if (rayPlaneIntersection(e, s, plane.a, plane.n, currT) && currT > safeT && currT < tMax) {
+			blocker = int(scene.spheres.size() + i);
+			return true;
+		}
+	}
+
+	glm::vec3 invD = 1.0f / (s - e);
+	blocker = -1;
+	return intersectBVH<true>(e, s, invD, tMax, blocker, SCENE_ROOT);
+}
+
+/*
+check if one primitive (of any type) blocks a ray before it reaches tMax
+	e: origin of ray
+	s: intersection of ray
+	primitive: primitive id
+	tMax: t value where the ray ends
+*/
+static bool primitiveBlocks(const point3 &e, const point3 &s, int primitive, float tMax) {
+	float safeT = 0.001f;
+	float currT;
+	int plane = primitive - int(scene.spheres.size());
+
+	if (plane >= 0 && plane < int(scene.planes.size())) {
+		return rayPlaneIntersection(e, s, scene.planes[plane].a, scene.planes[plane].n, currT) && currT > safeT && currT < tMax;
+	}
+
+	// any triangle of an instance will do, not just the closest
+	int instance = plane - int(scene.planes.size() + scene.triangles.size());
+	if (instance >= 0) {
+		int triangle;
+		currT = tMax;
+		return intersectInstance<true>(scene.instances[instance], e, s, currT, triangle);
+	}
+
+	return intersectPrimitive(e, s, primitive, currT) && currT > safeT && currT < tMax;
+}
+
+/*
+intersect a single sphere, triangle or instance by primitive id
+	e: origin of ray
+	s: intersection of ray
+	primitive: primitive id (planes are not allowed)
+	t: output t value for intersection, the closest one for an instance
+*/
+bool intersectPrimitive(const point3 &e, const point3 &s, int primitive, float &t) {
+	if (primitive < int(scene.spheres.size())) {
+		const Sphere &sphere = scene.spheres[primitive];
+		return raySphereIntersection(e, s, sphere.c, sphere.R, t);
+	}
+
+	int i = primitive - int(scene.spheres.size() + scene.planes.size());
+	if (i >= int(scene.triangles.size())) {
+		int triangle;
+		t = FLT_MAX;
+		return intersectInstance<false>(scene.instances[i - scene.triangles.size()], e, s, t, triangle);
+	}
+
+	const Triangle &triangle = scene.triangles[i];
+	float u, v;
+	return rayTriangleIntersection(e, s, triangle, t, u, v);
+}
+
+/*
+fill in the normal, material and barycentrics of a hit from its primitive id
+	e: origin of ray
+	s: intersection of ray
+	hit: hit with t and primitive already set
+*/
+void hitNormal(const point3 &e, const point3 &s, Hit &hit) {
+	int i = hit.primitive;
+	hit.u = hit.v = 0.0f;
+
+	if (i < int(scene.spheres.size())) {
+		const Sphere &sphere = scene.spheres[i];
+		point3 p = e + (s - e) * hit.t;
+		hit.normal = glm::normalize(p - sphere.c);
+		hit.material = sphere.material;
+		return;
+	}
+	i -= int(scene.spheres.size());
+
+	if (i < int(scene.planes.size())) {
+		hit.normal = scene.planes[i].n;
+		hit.material = scene.planes[i].material;
+		return;
+	}
+	i -= int(scene.planes.size());
+
+	if (i >= int(scene.triangles.size())) {
+		// the triangle of an instance is found again in object space, with the same ray
+		// transform and a limit just past the hit so the same triangle is hit again
+		const Instance &instance = scene.instances[i - scene.triangles.size()];
+		float tMin = std::nextafter(hit.t, FLT_MAX);
+		int closest = -1;
+		intersectInstance<false>(instance, e, s, tMin, closest);
+		if (closest < 0) {
+			hit.normal = glm::vec3(0.0f, 0.0f, 0.0f);
+			hit.material = instance.material >= 0 ? instance.material : 0;
+			return;
+		}
+
+		const Triangle &triangle = scene.triangles[closest - scene.spheres.size() - scene.planes.size()];
+		float t;
+		rayTriangleIntersection(instance.toObject * e + instance.toObjectOffset, instance.toObject * s + instance.toObjectOffset, triangle, t, hit.u, hit.v);
+		hit.normal = glm::normalize(instance.normalToWorld * triangle.n);
+		hit.material = instance.material >= 0 ? instance.material : triangle.material;
+		return;
+	}
+
+	// barycentrics are only needed for the closest triangle, so they are found again here
+	const Triangle &triangle = scene.triangles[i];
+	float t;
+	rayTriangleIntersection(e, s, triangle, t, hit.u, hit.v);
+	hit.normal = triangle.n;
+	hit.material = triangle.material;
+}
+
+/*
+light ponit of intersection
+	e: origin of ray (eye position initially)
+	p: point of intersection
+	n: normal at point of intersection
+	material: material properties of object at point of intersection
+	lit: whether each light reaches p, if already known (otherwise shadow rays are cast here)
+*/
+colour3 light(point3 e, point3 p, glm::vec3 n, const Material &material, const bool *lit) {
+	colour3 color = colour3(0, 0, 0);
+
+	n = glm::normalize(n);
+	glm::vec3 v = glm::normalize(e - p);
+
+	// for all lights in the scene...
+	for (size_t i = 0; i < scene.lights.size(); i++) {
+		const Light &light = scene.lights[i];
+		glm::vec3 l;
+
+		if (light.type == AMBIENT_LIGHT) {
+			if (material.hasDiffuse) {
+				color += light.color * material.ambient;
 				color = clamp(color);
 			}
 
 			continue;
 		}
+
+		point3 target;
+		if (!lightRay(light, p, l, target)) {
+			continue;
+		}
+
+		// dont add color if light doesnt reach the point
+		if (lit != NULL ? !lit[i] : pointInShadow(p, target, int(i))) {
+			continue;
+		}
+
+		// diffuse
+		if (material.hasDiffuse) {
+			float dotP = glm::dot(n, l);
+			if (dotP < 0.0f) dotP = 0.0f;
+			color += light.color * material.diffuse * dotP;
+			color = clamp(color);
+		}
+
+		// specular if material supports specular component
+		if (material.hasSpecular) {
+			glm::vec3 h = glm::normalize(l + v);
+
+			float dotP = glm::dot(n, h);
+			if (dotP < 0.0f) dotP = 0.0f;
+			color += light.color * material.specular * std::pow(dotP, material.shininess);
+			color = clamp(color);
+		}
 	}
 
 	return color;
 }
 
+/*
+find the direction to a light and the end point of the shadow ray towards it
+	light: a directional, point or spot light
+	p: point being lit
+	l: output normalized direction from p to the light
+	target: output end of the shadow ray (t = 1)
+	returns false if p is outside the light's cutoff angle
+*/
+bool lightRay(const Light &light, const point3 &p, glm::vec3 &l, point3 &target) {
+	if (light.type == DIRECTIONAL_LIGHT) {
+		l = -light.direction;
+		target = p + (l * 100.0f);
+		return true;
+	}
+
+	l = glm::normalize(light.position - p);
+	target = light.position;
+
+	// dont calculate light if point is outside the cutoff angle
+	return light.type != SPOT_LIGHT || glm::dot(l, -light.direction) >= light.cosCutoff;
+}
+
 /*
 Point in shadow test
 	p: the point to test
 	l: light position
+	light: index of the light, selects the occluder cache entry
 */
-bool pointInShadow(point3 p, point3 l) {
-	json object;
-	glm::vec3 normal;
-	float t = intersect(p, l, normal, object);
+bool pointInShadow(point3 p, point3 l, int light) {
+	int blocker;
 
-	if (t > 0.0f && t < 1.0f)
+	if (!useOccluderCache) {
+		return occluded(p, l, 1.0f, blocker);
+	}
+
+	ThreadState &state = threadState();
+	if (state.lastOccluder.size() != scene.lights.size()) {
+		state.lastOccluder.assign(scene.lights.size(), -1);
+	}
+
+	int &last = state.lastOccluder[light];
+	int primitives = int(scene.spheres.size() + scene.planes.size() + scene.triangles.size() + scene.instances.size());
+
+	if (last >= 0 && last < primitives) {
+		bump(state.lookups);
+
+		if (primitiveBlocks(p, l, last, 1.0f)) {
+			bump(state.hits);
+			return true;
+		}
+	}
+
+	if (occluded(p, l, 1.0f, blocker)) {
+		last = blocker;
 		return true;
+	}
 
 	return false;
 }
 
+// sum every thread's counters since the program started, the caller holds threadStatesMutex
+static void sumCounters(long long &lookups, long long &hits, long long &rays, long long &culled) {
+	lookups = 0;
+	hits = 0;
+	rays = 0;
+	culled = 0;
+
+	for (size_t i = 0; i < threadStates.size(); i++) {
+		lookups += threadStates[i]->lookups.load(std::memory_order_relaxed);
+		hits += threadStates[i]->hits.load(std::memory_order_relaxed);
+		rays += threadStates[i]->rays.load(std::memory_order_relaxed);
+		culled += threadStates[i]->culled.load(std::memory_order_relaxed);
+	}
+}
+
 /*
-Reflect the ray and find colour (recursive)
-	e: origin point of ray
-	p: point of intersection
-	n: normal at point of intersection
-	km: mirror constant property of object
-	colour: output color
-	interations: # of recursive iterations left
+resetRayStats start the occluder cache and ray counters again from zero, e.g. when a frame starts
 */
-void reflect(point3 e, point3 p, glm::vec3 n, glm::vec3 km, colour3 &colour, int iterations) {
-	glm::vec3 v = glm::normalize(e - p);
-	glm::vec3 r = glm::normalize(2 * glm::dot(n, v) * n - v);
-	colour3 hitColor;
+void resetRayStats() {
+	std::lock_guard<std::mutex> lock(threadStatesMutex);
+	sumCounters(baseLookups, baseHits, baseRays, baseCulled);
+}
 
-	if (castRay(p, p + r, hitColor, -1.0, iterations - 1)) {
-		hitColor = clamp(hitColor);
-		colour += hitColor * km;
-		colour = clamp(colour);
-	}
-	else {
-		colour += background_colour * km;
-		colour = clamp(colour);
-	}
+/*
+sum the occluder cache counters of every thread since the last resetRayStats()
+	lookups: output number of shadow rays that tested a cached occluder
+	hits: output number of those that were blocked by it
+*/
+void occluderCacheStats(long long &lookups, long long &hits) {
+	std::lock_guard<std::mutex> lock(threadStatesMutex);
+	long long rays, culled;
+	sumCounters(lookups, hits, rays, culled);
+	lookups -= baseLookups;
+	hits -= baseHits;
 }
 
 /*
-cast transparent ray and update color
-	p: point of intersection
-	d: direction of transparent ray
-	colour: output color
-	kt: transparent constant for material
-	iteractions: # of iterations left
+add to this thread's ray counters
+	rays: number of rays intersected with the scene
+	culled: number of reflected and refracted rays dropped for contributing too little
 */
-void transparentRay(point3 p, point3 d, colour3 &colour, glm::vec3 kt, int iterations) {
-	colour3 hitColor;
+void countRays(int rays, int culled) {
+	ThreadState &state = threadState();
+	bump(state.rays, rays);
+	bump(state.culled, culled);
+}
 
-	if (castRay(p, p + d, hitColor, -1.0, iterations - 1)) {
-		hitColor = clamp(hitColor);
-		colour = (1.0f - kt) * colour + hitColor * kt;
-		colour = clamp(colour);
-	}
-	else {
-		colour = (1.0f - kt) * colour + background_colour * kt;
-		colour = clamp(colour);
-	}
+/*
+sum the ray counters of every thread since the last resetRayStats()
+	rays: output number of camera, reflected and refracted rays intersected with the scene
+	culled: output number of reflected and refracted rays dropped for contributing too little
+*/
+void rayStats(long long &rays, long long &culled) {
+	std::lock_guard<std::mutex> lock(threadStatesMutex);
+	long long lookups, hits;
+	sumCounters(lookups, hits, rays, culled);
+	rays -= baseRays;
+	culled -= baseCulled;
 }
 
 /*
-reflect ray and update color
+direction of a ray reflected about the normal
+	e: origin point of ray
 	p: point of intersection
-	e: eye position
+	n: normal at point of intersection
+*/
+glm::vec3 reflectDirection(point3 e, point3 p, glm::vec3 n) {
+	glm::vec3 v = glm::normalize(e - p);
+	return glm::normalize(2 * glm::dot(n, v) * n - v);
+}
+
+/*
+direction of a ray refracted into or out of an object, returns false on total internal reflection
+	e: origin point of ray
 	s: point of intersection of ray
 	n: normal at point of intersection
-	colour: output color
-	ni: current index of refraction
-	kt: transparency constant for material
+	ni: current index of refraction (the ray is inside the object if > 0)
 	materialNR: material's index of refraction
-	iterations: # of iterations left
+	vr: output refracted direction
+	nextNi: output index of refraction the refracted ray travels in (-1.0 when leaving the object)
 */
-void refract(point3 p, point3 e, point3 s, glm::vec3 n, colour3 &colour, float ni, glm::vec3 kt, float materialNR, int iterations) {
-	colour3 hitColor;
-
+bool refractDirection(point3 e, point3 s, glm::vec3 n, float ni, float materialNR, glm::vec3 &vr, float &nextNi) {
 	if (ni > 0) {
 		float nr = 1.0f;
 
 		glm::vec3 vi = glm::normalize(s - e);
 		glm::vec3 N = glm::normalize(-n);
 
-		glm::vec3 vr = ((ni * (vi - N * glm::dot(vi, N))) / nr) - (N * std::sqrt(1 - ((glm::pow(ni, 2) * (1 - std::pow(glm::dot(vi, N), 2))) / std::pow(nr, 2))));
-
-		if (castRay(p, p + vr, hitColor, -1.0f, iterations - 1)) {
-			hitColor = clamp(hitColor);
-			colour = (1.0f - kt) * colour + hitColor * kt;
-			colour = clamp(colour);
-		}
-		else {
-			colour = (1.0f - kt) * colour + background_colour * kt;
-			colour = clamp(colour);
-		}
+		vr = ((ni * (vi - N * glm::dot(vi, N))) / nr) - (N * (float)std::sqrt(1 - ((glm::pow(ni, 2) * (1 - std::pow(glm::dot(vi, N), 2))) / std::pow(nr, 2))));
+		nextNi = -1.0f;
+		return true;
 	}
-	else {
-		float ni = 1.0f;
-		float nr = materialNR;
 
-		glm::vec3 vi = glm::normalize(s - e);
-		glm::vec3 N = glm::normalize(n);
+	ni = 1.0f;
+	float nr = materialNR;
 
-		if (glm::dot(vi, N) <= 1 - (std::pow(ni, 2) / std::pow(nr, 2))) {
-			glm::vec3 vr = ((ni * (vi - N * glm::dot(vi, N))) / nr) - (N * std::sqrt(1 - ((glm::pow(ni, 2) * (1 - std::pow(glm::dot(vi, N), 2))) / std::pow(nr, 2))));
+	glm::vec3 vi = glm::normalize(s - e);
+	glm::vec3 N = glm::normalize(n);
 
-			if (castRay(p, p + vr, hitColor, nr, iterations - 1)) {
-				hitColor = clamp(hitColor);
-				colour = (1.0f - kt) * colour + hitColor * kt;
-				colour = clamp(colour);
-			}
-			else {
-				colour = (1.0f - kt) * colour + background_colour * kt;
-				colour = clamp(colour);
-			}
-		}
-		else {
-			reflect(e, p, n, glm::vec3(1.0f, 1.0f, 1.0f), colour, iterations - 1);
-		}
+	if (glm::dot(vi, N) <= 1 - (std::pow(ni, 2) / std::pow(nr, 2))) {
+		vr = ((ni * (vi - N * glm::dot(vi, N))) / nr) - (N * (float)std::sqrt(1 - ((glm::pow(ni, 2) * (1 - std::pow(glm::dot(vi, N), 2))) / std::pow(nr, 2))));
+		nextNi = nr;
+		return true;
 	}
+
+	return false;
 }
 
 /*
-check for ray triangle itersection
+check for ray triangle itersection in a single pass (Moller-Trumbore)
 	e: eye position
 	s: ray intersection position
-	a: point a of triangle
-	b: point b of triangle
-	c: point c of triangle
-	n: normal of triangle
+	triangle: triangle with precomputed edges
 	t: output t value for intersection
+	u, v: output barycentric coordinates of the intersection (weights of b and c)
 */
-bool rayTriangleIntersection(point3 e, point3 s, point3 a, point3 b, point3 c, glm::vec3 n, float &t) {
-	n = glm::normalize(n);
-	float planeT;
+bool rayTriangleIntersection(const point3 &e, const point3 &s, const Triangle &triangle, float &t, float &u, float &v) {
+	glm::vec3 d = s - e;
+	glm::vec3 p = glm::cross(d, triangle.e2);
 
-	if (rayPlaneIntersection(e, s, a, n, planeT)) {
-		glm::vec3 d = s - e;
-		point3 x = e + d * planeT;
+	float determinant = glm::dot(triangle.e1, p);
+	if (determinant == 0)
+		return false;
 
-		float term1 = glm::dot(glm::cross((b - a), (x - a)), n);
-		float term2 = glm::dot(glm::cross((c - b), (x - b)), n);
-		float term3 = glm::dot(glm::cross((a - c), (x - c)), n);
+	float inverse = 1.0f / determinant;
+	glm::vec3 toOrigin = e - triangle.a;
 
-		if (term1 > 0 && term2 > 0 && term3 > 0) {
-			t = planeT;
-			return true;
-		}
-	}
+	u = glm::dot(toOrigin, p) * inverse;
+	if (u < 0 || u > 1)
+		return false;
 
-	return false;
+	glm::vec3 q = glm::cross(toOrigin, triangle.e1);
+
+	v = glm::dot(d, q) * inverse;
+	if (v < 0 || u + v > 1)
+		return false;
+
+	t = glm::dot(triangle.e2, q) * inverse;
+	return t >= 0;
 }
 
 /*
@@ -10,25 +10,51 @@
 #include <glm/gtx/string_cast.hpp>
 #include <iostream>
 
-#include "json.hpp"
+#include "scene.h"
 
-using json = nlohmann::json;
+// The closest intersection along a ray. Primitive ids number the spheres first,
+// then the planes, then the triangles, then the instances of the compiled scene.
+struct Hit {
+	float t;
+	glm::vec3 normal;
+	int primitive;
+	int material;
+	float u, v; // barycentric coordinates when a triangle was hit
+};
 
-typedef glm::vec3 point3;
-typedef glm::vec3 colour3;
+// most reflected and refracted rays followed from a camera ray
+const int MAX_RAY_DEPTH = 8;
+
+// largest packet of primary rays traced together (8x8 pixels)
+const int MAX_PACKET_RAYS = 64;
 
 extern double fov;
 extern colour3 background_colour;
+extern bool useOccluderCache;
+extern float minContribution; // reflected and refracted rays contributing less than this are not traced, 0 traces them all
+extern bool russianRoulette;
+extern int packetSize; // side of the square primary ray packets, 0 traces single rays
 
 void choose_scene(char const *fn);
+bool parseOption(const std::string &arg);
 bool trace(const point3 &e, const point3 &s, colour3 &colour, bool pick);
 bool castRay(const point3 &e, const point3 &s, colour3 &colour, float ni, int iterations);
-float intersect(point3 e, point3 s, glm::vec3 &normal, json &object);
-colour3 light(point3 e, point3 p, glm::vec3 n, json material);
-bool pointInShadow(point3 p, point3 l);
-void reflect(point3 e, point3 p, glm::vec3 n, glm::vec3 km, colour3 &colour, int iterations);
-void transparentRay(point3 p, point3 d, colour3 &colour, glm::vec3 kt, int iterations);
-void refract(point3 p, point3 e, point3 s, glm::vec3 n, colour3 &colour, float ni, glm::vec3 kt, float materialNR, int iterations);
-bool rayTriangleIntersection(point3 e, point3 s, point3 a, point3 b, point3 c, glm::vec3 n, float &t);
+void shade(const point3 &e, const point3 &s, const Hit &hit, colour3 &colour, float ni, int iterations);
+void tracePacket(const point3 &e, const point3 *s, int count, colour3 *colours, int *primitives);
+void intersectPacket(const point3 &e, const point3 *s, int count, Hit *hits, bool *found);
+bool intersect(const point3 &e, const point3 &s, Hit &hit);
+bool occluded(const point3 &e, const point3 &s, float tMax, int &blocker);
+bool intersectPrimitive(const point3 &e, const point3 &s, int primitive, float &t);
+void hitNormal(const point3 &e, const point3 &s, Hit &hit);
+colour3 light(point3 e, point3 p, glm::vec3 n, const Material &material, const bool *lit = NULL);
+bool lightRay(const Light &light, const point3 &p, glm::vec3 &l, point3 &target);
+bool pointInShadow(point3 p, point3 l, int light);
+void resetRayStats();
+void occluderCacheStats(long long &lookups, long long &hits);
+void countRays(int rays, int culled);
+void rayStats(long long &rays, long long &culled);
+glm::vec3 reflectDirection(point3 e, point3 p, glm::vec3 n);
+bool refractDirection(point3 e, point3 s, glm::vec3 n, float ni, float materialNR, glm::vec3 &vr, float &nextNi);
+bool rayTriangleIntersection(const point3 &e, const point3 &s, const Triangle &triangle, float &t, float &u, float &v);
 bool rayPlaneIntersection(point3 e, point3 s, point3 a, glm::vec3 n, float &t);
 bool raySphereIntersection(point3 e, point3 s, point3 c, float R, float &t);
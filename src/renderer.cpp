@@ -0,0 +1,553 @@
+/*
+	Tile renderer
+	Splits an image into tiles and traces them on the task pool, using packets or
+	wavefront streams within a tile when they are enabled. A progressive render
+	first traces one pixel in every 16x16 block of the image, then one in every 8x8
+	block and so on down to every pixel, each pass tracing only the new pixels.
+
+	With anti-aliasing on, two more passes follow. The first marks pixels whose
+	colour differs from a neighbour's by more than the threshold, or that hit a
+	different primitive, and the second traces extra samples in the marked pixels
+	only, a few at a time, until they agree or the sample limit is reached.
+
+	Viewers poll a render rather than waiting on it: every pixel written is also
+	stored, packed, in the preview with a relaxed atomic store, so a tile can be
+	copied out at any time without a lock. A copy taken during a pass may mix in
+	some of its pixels with the previous pass's, which is never visible for longer
+	than a refresh. A cancelled render's remaining tasks return at once, so the
+	viewer drops it and starts the next frame straight away.
+*/
+
+#define _USE_MATH_DEFINES
+#include <cmath>
+
+#include "renderer.h"
+#include "raytracer.h"
+#include "wavefront.h"
+
+#include <algorithm>
+#include <cstring>
+
+int tileSize = 32;
+bool progressive = true;
+int aaSamples = 1;
+float aaThreshold = 0.1f;
+
+// sub-pixel samples traced at once in a pixel being refined
+const int AA_BATCH = 4;
+
+/*
+point on the image plane a camera ray goes through (the eye is at the origin looking down -z)
+	x, y: position on the image in pixels, from the bottom left corner
+	width, height: size of the image in pixels
+*/
+point3 cameraRay(float x, float y, int width, int height) {
+	float d = 1;
+	float aspect_ratio = (float)width / height;
+	float h = d * (float)tan((M_PI * fov) / 180.0 / 2.0);
+	float w = h * aspect_ratio;
+
+	float top = h;
+	float bottom = -h;
+	float left = -w;
+	float right = w;
+
+	float u = left + (right - left) * x / width;
+	float v = bottom + (top - bottom) * y / height;
+
+	return point3(u, v, -d);
+}
+
+/*
+pack a colour as RGBA8 in memory order
+	colour: colour to pack, clamped to [0, 1]
+*/
+unsigned int packColour(const colour3 &colour) {
+	unsigned char bytes[4];
+	for (int c = 0; c < 3; c++) {
+		bytes[c] = (unsigned char)(glm::clamp(colour[c], 0.0f, 1.0f) * 255.0f + 0.5f);
+	}
+	bytes[3] = 255;
+
+	unsigned int packed;
+	memcpy(&packed, bytes, 4);
+	return packed;
+}
+
+// write a pixel, and its preview when there is one
+static void writePixel(Render &render, int x, int y, const colour3 &colour) {
+	storePixel(render.pixels, x, y, colour);
+
+	if (render.preview) {
+		render.preview[size_t(y) * render.width + x].store(packColour(colour), std::memory_order_relaxed);
+	}
+}
+
+/*
+position of the d-th cell along a Hilbert curve filling an n by n grid
+	n: side of the grid, a power of two
+	d: distance along the curve
+	x, y: output cell
+*/
+static void hilbertCell(int n, int d, int &x, int &y) {
+	x = 0;
+	y = 0;
+
+	for (int s = 1; s < n; s *= 2) {
+		int rx = 1 & (d / 2);
+		int ry = 1 & (d ^ rx);
+
+		// rotate the quadrant
+		if (ry == 0) {
+			if (rx == 1) {
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			std::swap(x, y);
+		}
+
+		x += s * rx;
+		y += s * ry;
+		d /= 4;
+	}
+}
+
+/*
+i-th number of the van der Corput sequence in a base, spread evenly over [0, 1)
+	base: prime base
+	i: index in the sequence, from 1
+*/
+static float radicalInverse(int base, int i) {
+	float inverse = 1.0f / base;
+	float scale = inverse;
+	float value = 0;
+
+	while (i > 0) {
+		value += (i % base) * scale;
+		i /= base;
+		scale *= inverse;
+	}
+	return value;
+}
+
+/*
+trace a list of camera rays, as one wavefront stream, in square packets or one at a time
+	render: render the rays belong to
+	positions: position of each ray on the image in pixels
+	colours: output colour of each ray
+	primitives: output primitive each ray hit first, -1 if it hit nothing
+*/
+static void tracePixels(Render &render, const std::vector<glm::vec2> &positions, std::vector<colour3> &colours, std::vector<int> &primitives) {
+	point3 eye(0, 0, 0);
+	int count = int(positions.size());
+	std::vector<point3> rays(count);
+
+	for (int i = 0; i < count; i++) {
+		rays[i] = cameraRay(positions[i].x, positions[i].y + render.originY, render.width, render.imageHeight);
+	}
+
+	colours.resize(count);
+	primitives.resize(count);
+
+	if (wavefrontMode != WAVEFRONT_OFF) {
+		traceStream(eye, rays.data(), count, colours.data(), primitives.data());
+	}
+	else if (packetSize > 0) {
+		int packet = packetSize * packetSize;
+
+		for (int i = 0; i < count; i += packet) {
+			tracePacket(eye, &rays[i], std::min(packet, count - i), &colours[i], &primitives[i]);
+		}
+	}
+	else {
+		for (int i = 0; i < count; i++) {
+			Hit hit;
+			primitives[i] = -1;
+			countRays(1, 0);
+
+			if (intersect(eye, rays[i], hit)) {
+				shade(eye, rays[i], hit, colours[i], -1.0, MAX_RAY_DEPTH);
+				primitives[i] = hit.primitive;
+			}
+		}
+	}
+
+	for (int i = 0; i < count; i++) {
+		if (primitives[i] < 0) {
+			colours[i] = background_colour;
+		}
+	}
+
+	int counted = 0;
+	for (int i = 0; i < count; i++) {
+		int y = int(positions[i].y);
+		if (y >= render.countedY0 && y < render.countedY1) {
+			counted++;
+		}
+	}
+	render.samples += counted;
+}
+
+// whether two samples differ enough to be worth refining
+static bool samplesDiffer(const colour3 &a, const colour3 &b) {
+	glm::vec3 d = glm::abs(a - b);
+	return d.x > aaThreshold || d.y > aaThreshold || d.z > aaThreshold;
+}
+
+/*
+mark the pixels of a tile that differ from a neighbour, which may be in another tile
+(every tile has finished tracing, and nothing writes pixels until the marking is done)
+	render: render the tile belongs to
+	tile: tile number, ty * tilesX + tx
+*/
+static void markEdges(Render &render, int tile) {
+	int x0, y0, x1, y1;
+	tileBounds(render, tile, x0, y0, x1, y1);
+
+	const int dx[4] = { 1, -1, 0, 0 };
+	const int dy[4] = { 0, 0, 1, -1 };
+
+	for (int y = y0; y < y1; y++) {
+		for (int x = x0; x < x1; x++) {
+			size_t i = size_t(y) * render.width + x;
+			colour3 colour = loadPixel(render.pixels, x, y);
+			bool edge = false;
+
+			for (int k = 0; k < 4 && !edge; k++) {
+				int nx = x + dx[k];
+				int ny = y + dy[k];
+				if (nx < 0 || ny < 0 || nx >= render.width || ny >= render.height)
+					continue;
+
+				size_t j = size_t(ny) * render.width + nx;
+				edge = render.primitives[i] != render.primitives[j] || samplesDiffer(colour, loadPixel(render.pixels, nx, ny));
+			}
+
+			render.edges[i] = edge;
+		}
+	}
+}
+
+/*
+trace more samples in the marked pixels of a tile, a batch at a time, until the samples
+of a pixel agree within the threshold or it has aaSamples of them
+	render: render the tile belongs to
+	tile: tile number, ty * tilesX + tx
+*/
+static void refineEdges(Render &render, int tile) {
+	int x0, y0, x1, y1;
+	tileBounds(render, tile, x0, y0, x1, y1);
+
+	struct Refined {
+		int x, y;
+		int samples;
+		colour3 sum, low, high;
+	};
+
+	std::vector<Refined> refining;
+	for (int y = y0; y < y1; y++) {
+		for (int x = x0; x < x1; x++) {
+			if (render.edges[size_t(y) * render.width + x]) {
+				colour3 colour = loadPixel(render.pixels, x, y);
+				Refined pixel = { x, y, 1, colour, colour, colour };
+				refining.push_back(pixel);
+			}
+		}
+	}
+
+	std::vector<Refined> done;
+	std::vector<glm::vec2> positions;
+	std::vector<colour3> colours;
+	std::vector<int> primitives;
+
+	while (!refining.empty() && !render.cancelled) {
+		// the same Halton points in every pixel, so neighbouring rays in a batch stay coherent
+		positions.clear();
+		for (size_t i = 0; i < refining.size(); i++) {
+			const Refined &pixel = refining[i];
+			int batch = std::min(AA_BATCH, aaSamples - pixel.samples);
+
+			for (int k = 0; k < batch; k++) {
+				int index = pixel.samples + k;
+				positions.push_back(glm::vec2(pixel.x + radicalInverse(2, index), pixel.y + radicalInverse(3, index)));
+			}
+		}
+
+		tracePixels(render, positions, colours, primitives);
+
+		size_t next = 0;
+		size_t kept = 0;
+		for (size_t i = 0; i < refining.size(); i++) {
+			Refined pixel = refining[i];
+			int batch = std::min(AA_BATCH, aaSamples - pixel.samples);
+
+			for (int k = 0; k < batch; k++) {
+				const colour3 &c = colours[next++];
+				pixel.sum += c;
+				pixel.low = glm::min(pixel.low, c);
+				pixel.high = glm::max(pixel.high, c);
+			}
+			pixel.samples += batch;
+
+			if (pixel.samples < aaSamples && samplesDiffer(pixel.low, pixel.high)) {
+				refining[kept++] = pixel;
+			}
+			else {
+				done.push_back(pixel);
+			}
+		}
+		refining.resize(kept);
+	}
+
+	for (size_t i = 0; i < done.size(); i++) {
+		writePixel(render, done[i].x, done[i].y, done[i].sum / float(done[i].samples));
+	}
+}
+
+/*
+trace the pixels of one tile that are new in a pass, and fill the block each one stands for
+until the finer passes trace the rest of it
+	render: render the tile belongs to
+	tile: tile number, ty * tilesX + tx
+	pass: tracing pass of the render, the pixels on a grid of 2^(tracingPasses - 1 - pass) are traced by the end of it
+*/
+static void renderTile(Render &render, int tile, int pass) {
+	int x0, y0, x1, y1;
+	tileBounds(render, tile, x0, y0, x1, y1);
+
+	int step = 1 << (render.tracingPasses - 1 - pass);
+	int first = step * 2; // pixels on this grid were traced by an earlier pass
+	int gx0 = (x0 + step - 1) / step * step;
+	int gy0 = (y0 + step - 1) / step * step;
+
+	// with packets, the pixels are listed in square blocks so each packet is coherent
+	int block = packetSize > 0 && wavefrontMode == WAVEFRONT_OFF ? packetSize * step : tileSize;
+	std::vector<glm::vec2> pixels;
+
+	for (int by = gy0; by < y1; by += block) {
+		for (int bx = gx0; bx < x1; bx += block) {
+			for (int y = by; y < std::min(by + block, y1); y += step) {
+				for (int x = bx; x < std::min(bx + block, x1); x += step) {
+					if (pass > 0 && x % first == 0 && y % first == 0)
+						continue;
+
+					pixels.push_back(glm::vec2(x + 0.5f, y + 0.5f));
+				}
+			}
+		}
+	}
+
+	std::vector<colour3> colours;
+	std::vector<int> primitives;
+	tracePixels(render, pixels, colours, primitives);
+
+	for (size_t i = 0; i < pixels.size(); i++) {
+		int x = int(pixels[i].x);
+		int y = int(pixels[i].y);
+		if (!render.primitives.empty()) {
+			render.primitives[size_t(y) * render.width + x] = primitives[i];
+		}
+
+		for (int fy = y; fy < std::min(y + step, y1); fy++) {
+			for (int fx = x; fx < std::min(x + step, x1); fx++) {
+				writePixel(render, fx, fy, colours[i]);
+			}
+		}
+	}
+}
+
+/*
+queue every tile of a pass; the last tile to finish queues the next pass
+	render: a started render
+	pass: pass to queue
+*/
+static void queuePass(Render &render, int pass) {
+	render.tilesLeft = int(render.tileOrder.size());
+
+	for (size_t i = 0; i < render.tileOrder.size(); i++) {
+		Render *target = &render;
+		int tile = render.tileOrder[i];
+
+		runTask(render.tasks, [target, tile, pass]() {
+			if (target->cancelled)
+				return;
+
+			if (pass < target->tracingPasses) {
+				renderTile(*target, tile, pass);
+			}
+			else if (pass == target->tracingPasses) {
+				markEdges(*target, tile);
+			}
+			else {
+				refineEdges(*target, tile);
+			}
+
+			// publishes the tile's pixels to threads reading the tile
+			target->tilePasses[tile].store(pass + 1, std::memory_order_release);
+			if (++target->passesFinished == target->tilesX * target->tilesY * target->passes) {
+				target->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - target->started).count();
+			}
+
+			if (--target->tilesLeft == 0 && pass + 1 < target->passes) {
+				queuePass(*target, pass + 1);
+			}
+		});
+	}
+}
+
+/*
+queue every tile of an image on the task pool and return without waiting for them
+	render: render to fill in, must be idle
+	width, height: size of the image in pixels
+	preview: keep an RGBA8 copy of the pixels that can be read while the render runs
+*/
+void startRender(Render &render, int width, int height, bool preview) {
+	startBand(render, width, height, 0, height, 0, preview);
+}
+
+/*
+queue every tile of a band of rows of an image on the task pool and return without waiting
+for them; the render holds only the band, whose bottom row is its row 0
+	render: render to fill in, must be idle
+	width, height: size of the whole image in pixels
+	y0, y1: first row of the band and one past its last row, from the bottom of the image
+	margin: rows also traced above and below the band (within the image) but left out of
+	its samples, so the edge pass can compare the band's outer rows with their neighbours
+	preview: keep an RGBA8 copy of the pixels that can be read while the render runs
+*/
+void startBand(Render &render, int width, int height, int y0, int y1, int margin, bool preview) {
+	bool antialiased = aaSamples > 1;
+
+	int bandY0 = y0, bandY1 = y1;
+	y0 = std::max(0, y0 - margin);
+	y1 = std::min(height, y1 + margin);
+	render.countedY0 = bandY0 - y0;
+	render.countedY1 = bandY1 - y0;
+
+	render.width = width;
+	render.height = y1 - y0;
+	render.imageHeight = height;
+	render.originY = y0;
+	render.tilesX = (width + tileSize - 1) / tileSize;
+	render.tilesY = (render.height + tileSize - 1) / tileSize;
+	render.tracingPasses = progressive ? PROGRESSIVE_PASSES : 1;
+	render.passes = render.tracingPasses + (antialiased ? 2 : 0);
+
+	size_t pixels = size_t(width) * render.height;
+	resizeFramebuffer(render.pixels, width, render.height, pixelFormat);
+	fillFramebuffer(render.pixels, background_colour);
+	render.primitives.assign(antialiased ? pixels : 0, -1);
+	render.edges.assign(antialiased ? pixels : 0, 0);
+	render.samples = 0;
+	render.tilePasses.reset(new std::atomic<int>[render.tilesX * render.tilesY]);
+	for (int i = 0; i < render.tilesX * render.tilesY; i++) {
+		render.tilePasses[i] = 0;
+	}
+	render.preview.reset();
+	if (preview) {
+		unsigned int background = packColour(background_colour);
+		render.preview.reset(new std::atomic<unsigned int>[pixels]);
+		for (size_t i = 0; i < pixels; i++) {
+			render.preview[i].store(background, std::memory_order_relaxed);
+		}
+	}
+	render.passesFinished = 0;
+	render.cancelled = false;
+
+	render.running = true;
+	render.started = std::chrono::steady_clock::now();
+
+	// the curve covers the smallest power of two grid containing every tile
+	int n = 1;
+	while (n < render.tilesX || n < render.tilesY) {
+		n *= 2;
+	}
+
+	render.tileOrder.clear();
+	for (int d = 0; d < n * n; d++) {
+		int tx, ty;
+		hilbertCell(n, d, tx, ty);
+		if (tx < render.tilesX && ty < render.tilesY) {
+			render.tileOrder.push_back(ty * render.tilesX + tx);
+		}
+	}
+
+	queuePass(render, 0);
+}
+
+/*
+pixels covered by a tile
+	render: a started render
+	tile: tile number, ty * tilesX + tx
+	x0, y0: output bottom left pixel of the tile
+	x1, y1: output one past the top right pixel of the tile
+*/
+void tileBounds(const Render &render, int tile, int &x0, int &y0, int &x1, int &y1) {
+	x0 = (tile % render.tilesX) * tileSize;
+	y0 = (tile / render.tilesX) * tileSize;
+	x1 = std::min(x0 + tileSize, render.width);
+	y1 = std::min(y0 + tileSize, render.height);
+}
+
+/*
+number of passes a tile has finished (its preview holds at least that pass from then on)
+	render: a started render
+	tile: tile number, ty * tilesX + tx
+*/
+int tilePassesDone(const Render &render, int tile) {
+	return render.tilePasses[tile].load(std::memory_order_acquire);
+}
+
+/*
+check whether every pass of every tile has finished and the render can be finished without waiting
+	render: a started render
+*/
+bool renderDone(const Render &render) {
+	return render.passesFinished == render.tilesX * render.tilesY * render.passes && renderIdle(render);
+}
+
+/*
+check whether none of a render's tasks are queued or running, so it can be restarted or freed
+	render: a started render
+*/
+bool renderIdle(const Render &render) {
+	return render.tasks.pending == 0;
+}
+
+/*
+stop a render without waiting for it: tiles being traced finish, the rest are skipped
+	render: a started render, left running until finishRender once renderIdle is true
+*/
+void cancelRender(Render &render) {
+	render.cancelled = true;
+}
+
+/*
+average number of camera rays traced per pixel so far
+	render: a started render
+*/
+double samplesPerPixel(const Render &render) {
+	return double(render.samples) / (double(render.width) * render.height);
+}
+
+/*
+wait for a render to finish, helping to trace its tiles
+	render: render to wait for (does nothing if it is not running)
+*/
+void finishRender(Render &render) {
+	if (!render.running)
+		return;
+
+	waitTasks(render.tasks);
+	render.running = false;
+}
+
+/*
+render a whole image on the task pool
+	render: output render
+	width, height: size of the image in pixels
+*/
+void renderImage(Render &render, int width, int height) {
+	startRender(render, width, height);
+	finishRender(render);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+// Renders whole images on the task pool. The image is split into square tiles that
+// are queued along a Hilbert curve, so consecutive tiles (and the threads working on
+// them) look at the same part of the scene. A render can keep an 8 bit preview that
+// viewers read without locking while the rest of the image is still rendering, and can
+// be cancelled without waiting for the tiles already being traced.
+
+#include "framebuffer.h"
+#include "scene.h"
+#include "tasks.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+extern int tileSize; // side of the square tiles in pixels
+extern bool progressive; // trace coarse passes over the whole image before the full resolution one
+
+extern int aaSamples; // most samples traced in a pixel, 1 turns anti-aliasing off
+extern float aaThreshold; // largest difference in any channel between samples that is left unrefined
+
+// passes of a progressive render, the first traces one pixel in every 16x16 block
+const int PROGRESSIVE_PASSES = 5;
+
+const int MAX_AA_SAMPLES = 64;
+
+struct Render {
+	int width, height; // size of the rendered rows, a band of the image or all of it
+	int imageHeight, originY; // height of the whole image and its row that is row 0 of the render
+	int tilesX, tilesY;
+	Framebuffer pixels; // read once the render has finished
+	// when anti-aliasing, the primitive hit through the centre of each pixel (-1 for none) and
+	// the pixels the edge pass picked for more samples, row y starting at y * width
+	std::vector<int> primitives;
+	std::vector<unsigned char> edges;
+	std::atomic<long long> samples; // rays traced from the camera so far, not counting a band's margin rows
+	int countedY0, countedY1; // rows of the render whose rays are counted, the band without its margins
+
+	// tracing passes, followed by a pass finding edges and one refining them when anti-aliasing
+	int passes, tracingPasses;
+	std::vector<int> tileOrder; // tiles (numbered row by row from the bottom left) in the order they are queued
+
+	// passes each tile has finished, their total, and the tiles left in the current pass
+	std::unique_ptr<std::atomic<int>[]> tilePasses;
+	std::atomic<int> passesFinished;
+	std::atomic<int> tilesLeft;
+
+	// RGBA8 copy of the pixels, row y starting at y * width, written as the tiles are traced (null if
+	// the render was started without a preview); a tile's pixels are complete for a pass once
+	// tilePassesDone shows it, and may already hold some of the next one
+	std::unique_ptr<std::atomic<unsigned int>[]> preview;
+
+	std::atomic<bool> cancelled; // tiles not started yet are skipped and no more passes are queued
+	TaskGroup tasks;
+	bool running;
+	std::chrono::steady_clock::time_point started;
+	double seconds; // time taken by the last finished render
+
+	Render() : width(0), height(0), imageHeight(0), originY(0), tilesX(0), tilesY(0), samples(0), countedY0(0), countedY1(0), passes(1), tracingPasses(1), passesFinished(0), tilesLeft(0), cancelled(false), running(false), seconds(0) {}
+};
+
+point3 cameraRay(float x, float y, int width, int height);
+unsigned int packColour(const colour3 &colour);
+void startRender(Render &render, int width, int height, bool preview = false);
+void startBand(Render &render, int width, int height, int y0, int y1, int margin = 0, bool preview = false);
+void tileBounds(const Render &render, int tile, int &x0, int &y0, int &x1, int &y1);
+int tilePassesDone(const Render &render, int tile);
+bool renderDone(const Render &render);
+bool renderIdle(const Render &render);
+void cancelRender(Render &render);
+double samplesPerPixel(const Render &render);
+void finishRender(Render &render);
+void renderImage(Render &render, int width, int height);
@@ -0,0 +1,677 @@
+/*
+	Scene compilation
+	Converts the JSON scene description into the flat arrays used while tracing.
+
+	Scenes are read with json.hpp's SAX interface rather than into a whole DOM. The
+	coordinates of mesh triangles go straight into the packed vertex buffer, and each
+	object is compiled as soon as its closing brace is read and then dropped, so the
+	DOM never holds more than the camera, the lights and one object without its
+	triangles. A DOM costs tens of bytes per number; the vertex buffer costs four.
+*/
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "scene.h"
+#include "meshfile.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <map>
+
+glm::vec3 vector_to_vec3(const std::vector<float> &v) {
+	return glm::vec3(v[0], v[1], v[2]);
+}
+
+/*
+get an optional vector property, returns false (and zero) if it is missing
+	j: json object to look in
+	key: name of the property
+	v: output vector
+*/
+static bool optionalVec3(json &j, const char *key, glm::vec3 &v) {
+	if (j.find(key) == j.end()) {
+		v = glm::vec3(0.0f, 0.0f, 0.0f);
+		return false;
+	}
+
+	v = vector_to_vec3(j[key]);
+	return true;
+}
+
+/*
+compile a material and add it to the scene
+	j: json material
+	compiled: scene to add the material to
+	returns the index of the material
+*/
+static int compileMaterial(json &j, Scene &compiled) {
+	Material material;
+
+	material.hasDiffuse = optionalVec3(j, "diffuse", material.diffuse);
+	material.hasSpecular = optionalVec3(j, "specular", material.specular);
+	material.hasReflective = optionalVec3(j, "reflective", material.reflective);
+	material.hasTransmissive = optionalVec3(j, "transmissive", material.transmissive);
+	optionalVec3(j, "ambient", material.ambient);
+
+	material.shininess = material.hasSpecular ? float(j["shininess"]) : 0.0f;
+
+	material.hasRefraction = j.find("refraction") != j.end();
+	material.refraction = material.hasRefraction ? float(j["refraction"]) : 1.0f;
+
+	compiled.materials.push_back(material);
+	return int(compiled.materials.size()) - 1;
+}
+
+/*
+add a triangle over already packed vertices and precompute its edges and normal
+	compiled: scene to add the triangle to
+	ia, ib, ic: indices of the corners in the scene vertex buffer
+	material: material index of the triangle
+*/
+void addTriangle(Scene &compiled, int ia, int ib, int ic, int material) {
+	compiled.indices.push_back(ia);
+	compiled.indices.push_back(ib);
+	compiled.indices.push_back(ic);
+
+	Triangle triangle;
+	triangle.a = compiled.vertices[ia];
+	triangle.e1 = compiled.vertices[ib] - triangle.a;
+	triangle.e2 = compiled.vertices[ic] - triangle.a;
+	triangle.n = glm::normalize(glm::cross(triangle.e1, triangle.e2));
+	triangle.material = material;
+	compiled.triangles.push_back(triangle);
+}
+
+// hash of a vertex position for welding, with -0 and 0 the same
+static size_t positionHash(const point3 &p) {
+	uint32_t bits[3];
+	point3 q = p + point3(0.0f, 0.0f, 0.0f);
+	memcpy(bits, &q, sizeof(bits));
+
+	uint64_t h = bits[0];
+	h = h * 0x9e3779b97f4a7c15ull ^ bits[1];
+	h = h * 0x9e3779b97f4a7c15ull ^ bits[2];
+	h *= 0x9e3779b97f4a7c15ull;
+	return size_t(h ^ (h >> 32));
+}
+
+/*
+merge the vertices of a mesh that are at exactly the same position, compacting them in place
+	compiled: scene whose vertex buffer ends with the mesh's vertices
+	firstVertex: first vertex of the mesh
+	remap: output scene vertex each of the mesh's vertices was merged into, in their original order
+*/
+static void weldVertices(Scene &compiled, size_t firstVertex, std::vector<int> &remap) {
+	size_t n = compiled.vertices.size() - firstVertex;
+	remap.resize(n);
+
+	// open addressing table of welded vertices, at most half full
+	size_t slots = 16;
+	while (slots < 2 * n) {
+		slots *= 2;
+	}
+	std::vector<int> table(slots, -1);
+
+	// each vertex is only ever moved down over ones already read
+	size_t welded = firstVertex;
+	for (size_t i = 0; i < n; i++) {
+		point3 p = compiled.vertices[firstVertex + i];
+		size_t slot = positionHash(p) & (slots - 1);
+		while (table[slot] >= 0 && compiled.vertices[table[slot]] != p) {
+			slot = (slot + 1) & (slots - 1);
+		}
+
+		if (table[slot] < 0) {
+			table[slot] = int(welded);
+			compiled.vertices[welded++] = p;
+		}
+		remap[i] = table[slot];
+	}
+
+	compiled.vertices.resize(welded);
+}
+
+/*
+weld the vertices of a mesh and add its triangles, leaving out degenerate ones
+	compiled: scene whose vertex buffer ends with the mesh's vertices
+	firstVertex: first vertex of the mesh
+	corners: three indices into the mesh's vertices per triangle, or null if every three
+	consecutive vertices are a triangle
+	material: material index of the triangles
+	returns the number of degenerate triangles left out
+*/
+static size_t addMeshTriangles(Scene &compiled, size_t firstVertex, const std::vector<int> *corners, int material) {
+	size_t cornerCount = corners != NULL ? corners->size() : compiled.vertices.size() - firstVertex;
+	std::vector<int> remap;
+	weldVertices(compiled, firstVertex, remap);
+
+	compiled.indices.reserve(compiled.indices.size() + cornerCount);
+	compiled.triangles.reserve(compiled.triangles.size() + cornerCount / 3);
+
+	size_t degenerate = 0;
+	for (size_t i = 0; i + 2 < cornerCount; i += 3) {
+		int ia = remap[corners != NULL ? (*corners)[i] : i];
+		int ib = remap[corners != NULL ? (*corners)[i + 1] : i + 1];
+		int ic = remap[corners != NULL ? (*corners)[i + 2] : i + 2];
+
+		// triangles with no area can never be hit
+		glm::vec3 normal = glm::cross(compiled.vertices[ib] - compiled.vertices[ia], compiled.vertices[ic] - compiled.vertices[ia]);
+		if (ia == ib || ib == ic || ia == ic || glm::dot(normal, normal) == 0.0f) {
+			degenerate++;
+			continue;
+		}
+
+		addTriangle(compiled, ia, ib, ic, material);
+	}
+
+	return degenerate;
+}
+
+// What compiling an object needs to know beyond the object itself
+struct ObjectContext {
+	std::string directory; // mesh files are named relative to this, empty or ending in a separator
+	std::map<std::string, int> meshes; // named meshes compiled so far
+};
+
+/*
+compile the transform of an instance, given as a matrix or as a scale, rotation and position
+	object: json instance
+	instance: output instance, whose transforms are set
+	error: output description of what was wrong with the transform
+	returns false if the transform cannot be inverted
+*/
+static bool compileTransform(json &object, Instance &instance, std::string &error) {
+	glm::mat3 linear(1.0f);
+	glm::vec3 offset(0.0f, 0.0f, 0.0f);
+
+	if (object.find("matrix") != object.end()) {
+		// the rows of a 3x4 matrix, or of a 4x4 one whose last row is ignored
+		std::vector<float> m = object["matrix"];
+		if (m.size() != 12 && m.size() != 16) {
+			error = "an instance matrix must have 12 or 16 numbers";
+			return false;
+		}
+		for (int row = 0; row < 3; row++) {
+			for (int column = 0; column < 3; column++) {
+				linear[column][row] = m[row * 4 + column];
+			}
+			offset[row] = m[row * 4 + 3];
+		}
+	}
+	else {
+		// scaled, then rotated about x, y and z in turn (in degrees), then moved to position
+		glm::vec3 scale(1.0f, 1.0f, 1.0f);
+		if (object.find("scale") != object.end()) {
+			scale = object["scale"].is_number() ? glm::vec3(float(object["scale"])) : vector_to_vec3(object["scale"]);
+		}
+		glm::vec3 rotation(0.0f, 0.0f, 0.0f);
+		optionalVec3(object, "rotation", rotation);
+		optionalVec3(object, "position", offset);
+
+		glm::mat4 rotate(1.0f);
+		rotate = glm::rotate(rotate, glm::radians(rotation.z), glm::vec3(0.0f, 0.0f, 1.0f));
+		rotate = glm::rotate(rotate, glm::radians(rotation.y), glm::vec3(0.0f, 1.0f, 0.0f));
+		rotate = glm::rotate(rotate, glm::radians(rotation.x), glm::vec3(1.0f, 0.0f, 0.0f));
+		linear = glm::mat3(rotate) * glm::mat3(glm::scale(glm::mat4(1.0f), scale));
+	}
+
+	float determinant = glm::determinant(linear);
+	if (!(determinant != 0.0f && std::isfinite(determinant))) {
+		error = "an instance transform must not flatten its mesh";
+		return false;
+	}
+
+	instance.toWorld = linear;
+	instance.toWorldOffset = offset;
+	instance.toObject = glm::inverse(linear);
+	instance.toObjectOffset = -(instance.toObject * offset);
+
+	// normals of mirrored triangles turn over, like the cross product of their mirrored edges
+	instance.normalToWorld = glm::transpose(instance.toObject) * (determinant < 0.0f ? -1.0f : 1.0f);
+	return true;
+}
+
+/*
+compile one object of the scene
+	object: json object, a mesh's triangles may already be in the vertex buffer instead
+	compiled: scene to add the object to
+	firstVertex: first vertex of a mesh whose triangles are already in the vertex buffer
+	(every vertex from there on belongs to it)
+	context: the mesh file directory and the meshes named so far, a named mesh is added
+	error: output description of what was wrong with the object
+	returns false if the object names a mesh file that could not be read, or is an instance that cannot be made
+*/
+static bool compileObject(json &object, Scene &compiled, size_t firstVertex, ObjectContext &context, std::string &error) {
+	// streamed triangles of any other object are already in the vertex buffer, and would be left there unused
+	if (object["type"] != "mesh" && (object.find("triangles") != object.end() || compiled.vertices.size() > firstVertex)) {
+		error = "only a mesh has triangles";
+		return false;
+	}
+
+	if (object["type"] == "sphere") {
+		Sphere sphere;
+		sphere.c = vector_to_vec3(object["position"]);
+		sphere.R = float(object["radius"]);
+		sphere.material = compileMaterial(object["material"], compiled);
+		compiled.spheres.push_back(sphere);
+	}
+	else if (object["type"] == "plane") {
+		Plane plane;
+		plane.a = vector_to_vec3(object["position"]);
+		plane.n = glm::normalize(vector_to_vec3(object["normal"]));
+		plane.material = compileMaterial(object["material"], compiled);
+		compiled.planes.push_back(plane);
+	}
+	else if (object["type"] == "mesh") {
+		Mesh mesh;
+		mesh.material = compileMaterial(object["material"], compiled);
+		mesh.firstTriangle = int(compiled.triangles.size());
+
+		if (object.find("file") != object.end()) {
+			// streamed triangles are already in the vertex buffer, and would be left there unused
+			if (object.find("triangles") != object.end() || compiled.vertices.size() > firstVertex) {
+				error = "a mesh gives either triangles or a file, not both";
+				return false;
+			}
+
+			// an indexed mesh from an OBJ or PLY file
+			std::string path = object["file"];
+			if (path.empty() || (path[0] != '/' && path[0] != '\\' && (path.size() < 2 || path[1] != ':'))) {
+				path = context.directory + path;
+			}
+
+			std::vector<point3> vertices;
+			std::vector<int> corners;
+			if (!loadMeshFile(path, vertices, corners, error)) {
+				error = "unable to read mesh file " + path + ": " + error;
+				return false;
+			}
+
+			firstVertex = compiled.vertices.size();
+			compiled.vertices.reserve(firstVertex + vertices.size());
+			for (const point3 &v : vertices) {
+				compiled.vertices.push_back(v);
+			}
+			std::vector<point3>().swap(vertices);
+
+			size_t degenerate = addMeshTriangles(compiled, firstVertex, &corners, mesh.material);
+			std::cout << "Read mesh " << path << ": " << corners.size() / 3 << " triangles, " << compiled.vertices.size() - firstVertex
+				<< " vertices after welding, " << degenerate << " degenerate triangles removed\n";
+		}
+		else {
+			if (object.find("triangles") != object.end()) {
+				json &triangles = object["triangles"];
+				for (json::iterator t = triangles.begin(); t != triangles.end(); ++t) {
+					for (int k = 0; k < 3; k++) {
+						json &corner = (*t)[k];
+						compiled.vertices.push_back(point3(float(corner[0]), float(corner[1]), float(corner[2])));
+					}
+				}
+			}
+
+			addMeshTriangles(compiled, firstVertex, NULL, mesh.material);
+		}
+
+		mesh.triangleCount = int(compiled.triangles.size()) - mesh.firstTriangle;
+
+		// a named mesh is only drawn by its instances
+		mesh.prototype = 0;
+		if (object.find("name") != object.end()) {
+			std::string name = object["name"];
+			if (context.meshes.count(name) > 0) {
+				error = "there are two meshes named " + name;
+				return false;
+			}
+			mesh.prototype = 1;
+			context.meshes[name] = int(compiled.meshes.size());
+		}
+		compiled.meshes.push_back(mesh);
+	}
+	else if (object["type"] == "instance") {
+		std::string name = object["mesh"];
+		std::map<std::string, int>::iterator mesh = context.meshes.find(name);
+		if (mesh == context.meshes.end()) {
+			error = "an instance uses the mesh " + name + ", which is not named by a mesh before it";
+			return false;
+		}
+
+		Instance instance;
+		instance.mesh = mesh->second;
+		instance.material = object.find("material") != object.end() ? compileMaterial(object["material"], compiled) : -1;
+		if (!compileTransform(object, instance, error))
+			return false;
+		compiled.instances.push_back(instance);
+	}
+
+	return true;
+}
+
+/*
+compile the lights of the scene
+	lights: json array of lights
+	compiled: scene to add the lights to
+*/
+static void compileLights(json &lights, Scene &compiled) {
+	for (json::iterator it = lights.begin(); it != lights.end(); ++it) {
+		json &light = *it;
+		Light compiledLight;
+
+		compiledLight.color = vector_to_vec3(light["color"]);
+		compiledLight.position = glm::vec3(0.0f, 0.0f, 0.0f);
+		compiledLight.direction = glm::vec3(0.0f, 0.0f, 0.0f);
+		compiledLight.cosCutoff = -1.0f;
+
+		if (light["type"] == "ambient") {
+			compiledLight.type = AMBIENT_LIGHT;
+		}
+		else if (light["type"] == "directional") {
+			compiledLight.type = DIRECTIONAL_LIGHT;
+			compiledLight.direction = glm::normalize(vector_to_vec3(light["direction"]));
+		}
+		else if (light["type"] == "point") {
+			compiledLight.type = POINT_LIGHT;
+			compiledLight.position = vector_to_vec3(light["position"]);
+		}
+		else if (light["type"] == "spot") {
+			compiledLight.type = SPOT_LIGHT;
+			compiledLight.position = vector_to_vec3(light["position"]);
+			compiledLight.direction = glm::normalize(vector_to_vec3(light["direction"]));
+			compiledLight.cosCutoff = glm::cos(glm::radians(float(light["cutoff"])));
+		}
+		else {
+			continue;
+		}
+
+		compiled.lights.push_back(compiledLight);
+	}
+}
+
+static void printCompiled(const Scene &compiled) {
+	std::cout << "Compiled scene: " << compiled.spheres.size() << " spheres, " << compiled.planes.size() << " planes, "
+		<< compiled.triangles.size() << " triangles (" << compiled.vertices.size() << " vertices), " << compiled.instances.size() << " instances, "
+		<< compiled.lights.size() << " lights\n";
+}
+
+/*
+compile a json scene already read into a DOM into flat arrays of primitives, materials and lights
+	j: json scene
+	directory: directory mesh files are named relative to, empty or ending in a separator
+	compiled: output scene
+	error: output description of what was wrong with the scene
+	returns false if a mesh file could not be read
+*/
+bool compileScene(json &j, const std::string &directory, Scene &compiled, std::string &error) {
+	compiled = Scene();
+	ObjectContext context;
+	context.directory = directory;
+
+	json &objects = j["objects"];
+	for (json::iterator it = objects.begin(); it != objects.end(); ++it) {
+		if (!compileObject(*it, compiled, compiled.vertices.size(), context, error))
+			return false;
+	}
+
+	compileLights(j["lights"], compiled);
+	printCompiled(compiled);
+	return true;
+}
+
+// SAX handler that builds a DOM of everything but the triangles of the scene's objects,
+// and compiles each object as soon as it ends
+class SceneReader : public nlohmann::json_sax<json> {
+public:
+	std::string error;
+
+	SceneReader(json &root, Scene &compiled, const std::string &directory) : root(root), element(NULL), compiled(compiled),
+		depth(0), objectsDepth(-1), trianglesDepth(-1), nextIsObjects(false), nextIsTriangles(false),
+		firstVertex(0), corners(0), coordinates(0) {
+		context.directory = directory;
+	}
+
+	bool null() override {
+		return value() && add(json(nullptr));
+	}
+
+	bool boolean(bool b) override {
+		return value() && add(json(b));
+	}
+
+	bool number_integer(number_integer_t n) override {
+		return trianglesDepth >= 0 ? coordinate(float(n)) : value() && add(json(n));
+	}
+
+	bool number_unsigned(number_unsigned_t n) override {
+		return trianglesDepth >= 0 ? coordinate(float(n)) : value() && add(json(n));
+	}
+
+	bool number_float(number_float_t n, const string_t &) override {
+		return trianglesDepth >= 0 ? coordinate(float(n)) : value() && add(json(n));
+	}
+
+	bool string(string_t &s) override {
+		return value() && add(json(std::move(s)));
+	}
+
+	bool start_object(size_t) override {
+		if (!value())
+			return false;
+
+		depth++;
+		if (depth == objectsDepth + 1) {
+			firstVertex = compiled.vertices.size();
+		}
+		return open(json(json::value_t::object));
+	}
+
+	bool key(string_t &k) override {
+		// the objects array of the scene, and the triangles of one of its objects
+		nextIsObjects = depth == 1 && k == "objects";
+		nextIsTriangles = objectsDepth >= 0 && depth == objectsDepth + 1 && k == "triangles";
+
+		// the value that follows is stored here, a later duplicate key replaces it
+		if (!nextIsTriangles) {
+			element = &(*openValues.back())[k];
+		}
+		return true;
+	}
+
+	bool end_object() override {
+		depth--;
+		openValues.pop_back();
+
+		// an object of the scene is compiled and dropped as soon as it is complete
+		if (depth == objectsDepth) {
+			json &objects = *openValues.back();
+			std::string objectError;
+			if (!compileObject(objects.back(), compiled, firstVertex, context, objectError))
+				return fail(objectError);
+			objects.erase(objects.size() - 1);
+		}
+		return true;
+	}
+
+	bool start_array(size_t) override {
+		if (nextIsTriangles) {
+			nextIsTriangles = false;
+			trianglesDepth = depth + 1;
+		}
+		else if (trianglesDepth < 0) {
+			bool objects = nextIsObjects;
+			if (!value())
+				return false;
+			if (objects) {
+				objectsDepth = depth + 1;
+			}
+		}
+		depth++;
+
+		// a triangle is an array of three corners, each an array of three coordinates
+		if (trianglesDepth >= 0) {
+			int level = depth - trianglesDepth;
+			if (level > 2)
+				return fail("a triangle corner must be an array of 3 numbers");
+			if (level == 1) {
+				corners = 0;
+			}
+			if (level == 2) {
+				coordinates = 0;
+			}
+			return true;
+		}
+
+		return open(json(json::value_t::array));
+	}
+
+	bool end_array() override {
+		depth--;
+
+		if (trianglesDepth >= 0) {
+			int level = depth + 1 - trianglesDepth;
+			if (level == 0) {
+				trianglesDepth = -1;
+			}
+			if (level == 1 && corners != 3)
+				return fail("a triangle must have 3 corners");
+			if (level == 2) {
+				if (coordinates != 3)
+					return fail("a triangle corner must be an array of 3 numbers");
+				compiled.vertices.push_back(corner);
+				corners++;
+			}
+			return true;
+		}
+
+		if (depth + 1 == objectsDepth) {
+			objectsDepth = -1;
+		}
+		openValues.pop_back();
+		return true;
+	}
+
+	// the exception already gives the line and column, the token shows what was found there
+	bool parse_error(size_t, const std::string &token, const json::exception &e) override {
+		return fail(std::string(e.what()) + " near '" + token + "'");
+	}
+
+private:
+	json &root;
+	std::vector<json *> openValues; // the arrays and objects being built, innermost last
+	json *element; // where the value after an object's key goes
+	Scene &compiled;
+	ObjectContext context;
+
+	int depth; // arrays and objects open
+	int objectsDepth; // depth inside the scene's objects array, -1 outside it
+	int trianglesDepth; // depth inside an object's triangles array, -1 outside it
+	bool nextIsObjects, nextIsTriangles; // the last key names the array that follows
+
+	size_t firstVertex; // first vertex of the object being read
+	int corners, coordinates; // read so far of the triangle and the corner being read
+	point3 corner;
+
+	// any value but a number inside triangles is an error, and every value ends a key's expectation
+	bool value() {
+		if (trianglesDepth >= 0)
+			return fail("a triangle corner must be an array of 3 numbers");
+		if (nextIsTriangles)
+			return fail("the triangles of an object must be an array");
+
+		nextIsObjects = false;
+		nextIsTriangles = false;
+		return true;
+	}
+
+	// store a value in the array or object being built, or as the root
+	json *store(json &&v) {
+		if (openValues.empty()) {
+			root = std::move(v);
+			return &root;
+		}
+
+		json &parent = *openValues.back();
+		if (parent.is_array()) {
+			parent.push_back(std::move(v));
+			return &parent.back();
+		}
+
+		*element = std::move(v);
+		return element;
+	}
+
+	bool add(json &&v) {
+		store(std::move(v));
+		return true;
+	}
+
+	// start building an array or object, its values go into it until it ends
+	bool open(json &&v) {
+		openValues.push_back(store(std::move(v)));
+		return true;
+	}
+
+	bool coordinate(float c) {
+		if (depth - trianglesDepth != 2 || coordinates == 3)
+			return fail("a triangle corner must be an array of 3 numbers");
+
+		corner[coordinates++] = c;
+		return true;
+	}
+
+	bool fail(const std::string &message) {
+		if (error.empty()) {
+			error = message;
+		}
+		return false;
+	}
+};
+
+/*
+read a json scene and compile it, streaming the triangles of meshes straight into the
+compiled scene instead of reading the whole file into a DOM
+	in: stream holding the scene
+	directory: directory mesh files are named relative to, empty or ending in a separator
+	j: output json scene, holding everything but its objects (which are compiled as they are read)
+	compiled: output scene
+	error: output description of what was wrong with the file
+	returns false if the file is not a valid scene or a mesh file could not be read
+*/
+bool loadScene(std::istream &in, const std::string &directory, json &j, Scene &compiled, std::string &error) {
+	compiled = Scene();
+	j = json();
+
+	SceneReader reader(j, compiled, directory);
+	if (!json::sax_parse(in, &reader)) {
+		error = reader.error;
+		return false;
+	}
+
+	compileLights(j["lights"], compiled);
+	printCompiled(compiled);
+	return true;
+}
+
+/*
+largest amount of memory the process has held at once, in bytes
+*/
+size_t peakMemoryBytes() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return counters.PeakWorkingSetSize;
+	return 0;
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return size_t(usage.ru_maxrss) * 1024; // kilobytes on Linux
+#endif
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+// The compiled scene: the JSON scene description flattened into typed arrays of
+// primitives, materials and lights so the ray tracer never touches the JSON after load.
+
+#include <glm/glm.hpp>
+
+#include <cstddef>
+#include <cstring>
+#include <istream>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+#include "bvh.h"
+#include "mapped.h"
+
+using json = nlohmann::json;
+
+typedef glm::vec3 point3;
+typedef glm::vec3 colour3;
+
+struct Material {
+	colour3 ambient;
+	colour3 diffuse;
+	colour3 specular;
+	float shininess;
+	glm::vec3 reflective;
+	glm::vec3 transmissive;
+	float refraction;
+
+	// which of the optional properties were given in the scene file
+	bool hasDiffuse;
+	bool hasSpecular;
+	bool hasReflective;
+	bool hasTransmissive;
+	bool hasRefraction;
+};
+
+// the flags leave the last bytes of a Material as padding
+inline void clearPadding(Material &material) {
+	size_t end = offsetof(Material, hasRefraction) + sizeof(material.hasRefraction);
+	memset((char *)&material + end, 0, sizeof(Material) - end);
+}
+
+struct Sphere {
+	point3 c;
+	float R;
+	int material;
+};
+
+struct Plane {
+	point3 a;
+	glm::vec3 n; // normalized
+	int material;
+};
+
+// Per-triangle data precomputed at load for intersection, packed contiguously
+// for all meshes in the scene.
+struct Triangle {
+	point3 a;
+	glm::vec3 e1; // b - a
+	glm::vec3 e2; // c - a
+	glm::vec3 n;  // normalized
+	int material;
+};
+
+// A mesh is a range of the scene's packed index and triangle buffers. Vertices
+// are shared by all meshes and indexed three per triangle.
+struct Mesh {
+	int firstTriangle;
+	int triangleCount;
+	int material;
+	int prototype; // named, so only drawn by instances and left out of the scene's own BVH
+};
+
+// A copy of a mesh placed with an affine transform. Rays are moved into the mesh's space
+// to be traced against its own BVH; the t of a hit is the same in both spaces.
+struct Instance {
+	glm::mat3 toWorld; // world position = toWorld * object position + toWorldOffset
+	glm::vec3 toWorldOffset;
+	glm::mat3 toObject; // object position = toObject * world position + toObjectOffset
+	glm::vec3 toObjectOffset;
+	glm::mat3 normalToWorld; // inverse transpose of the linear part, sign corrected for mirroring
+	int mesh;
+	int material; // -1 keeps the materials of the mesh's triangles
+};
+
+enum LightType {
+	AMBIENT_LIGHT,
+	DIRECTIONAL_LIGHT,
+	POINT_LIGHT,
+	SPOT_LIGHT
+};
+
+struct Light {
+	LightType type;
+	colour3 color;
+	point3 position;
+	glm::vec3 direction; // normalized, points away from the light
+	float cosCutoff;     // cosine of the spot light half angle
+};
+
+// The arrays are built by compileScene and loadScene, or are views of a mapped binary
+// scene file (see scenefile.h), which file then keeps mapped.
+struct Scene {
+	MappedArray<Material> materials;
+	MappedArray<Sphere> spheres;
+	MappedArray<Plane> planes;
+	MappedArray<Triangle> triangles;
+	MappedArray<Light> lights;
+
+	MappedArray<Mesh> meshes;
+	MappedArray<point3> vertices;
+	MappedArray<int> indices;
+	MappedArray<Instance> instances;
+
+	std::shared_ptr<MappedFile> file;
+
+	BVH bvh;
+};
+
+extern Scene scene;
+
+glm::vec3 vector_to_vec3(const std::vector<float> &v);
+bool compileScene(json &j, const std::string &directory, Scene &compiled, std::string &error);
+bool loadScene(std::istream &in, const std::string &directory, json &j, Scene &compiled, std::string &error);
+size_t peakMemoryBytes();
+void addTriangle(Scene &compiled, int ia, int ib, int ic, int material);
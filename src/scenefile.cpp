@@ -0,0 +1,130 @@
+/*
+	Binary scene files
+	The structs are written raw, so a file is only readable by builds with the same
+	struct layout and byte order; the header records both and mapping refuses a file
+	that does not match. The contents of the arrays are trusted as written by
+	scenetool, since checking every triangle would touch every page of the file.
+*/
+
+#include "scenefile.h"
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+/*
+write a compiled scene as a binary scene file
+	path: file to write
+	compiled: scene to write (its BVH is not written)
+	camera: camera properties of the JSON scene
+	returns false if the file could not be written
+*/
+bool writeSceneFile(const std::string &path, const Scene &compiled, json &camera) {
+	SceneFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic));
+	header.version = SCENE_FILE_VERSION;
+	header.byteOrder = FILE_BYTE_ORDER_MARK;
+
+	if (camera.find("field") != camera.end()) {
+		header.hasField = 1;
+		header.field = camera["field"];
+	}
+	if (camera.find("background") != camera.end()) {
+		header.hasBackground = 1;
+		glm::vec3 background = vector_to_vec3(camera["background"]);
+		for (int c = 0; c < 3; c++) {
+			header.background[c] = background[c];
+		}
+	}
+
+	uint64_t offset = sizeof(header);
+	placeArray(header.arrays[MATERIALS_SECTION], compiled.materials, offset);
+	placeArray(header.arrays[SPHERES_SECTION], compiled.spheres, offset);
+	placeArray(header.arrays[PLANES_SECTION], compiled.planes, offset);
+	placeArray(header.arrays[TRIANGLES_SECTION], compiled.triangles, offset);
+	placeArray(header.arrays[LIGHTS_SECTION], compiled.lights, offset);
+	placeArray(header.arrays[MESHES_SECTION], compiled.meshes, offset);
+	placeArray(header.arrays[VERTICES_SECTION], compiled.vertices, offset);
+	placeArray(header.arrays[INDICES_SECTION], compiled.indices, offset);
+	placeArray(header.arrays[INSTANCES_SECTION], compiled.instances, offset);
+
+	std::ofstream out(path, std::ios::binary);
+	if (!out.is_open())
+		return false;
+
+	out.write((const char *)&header, sizeof(header));
+	writeArray(out, header.arrays[MATERIALS_SECTION], compiled.materials);
+	writeArray(out, header.arrays[SPHERES_SECTION], compiled.spheres);
+	writeArray(out, header.arrays[PLANES_SECTION], compiled.planes);
+	writeArray(out, header.arrays[TRIANGLES_SECTION], compiled.triangles);
+	writeArray(out, header.arrays[LIGHTS_SECTION], compiled.lights);
+	writeArray(out, header.arrays[MESHES_SECTION], compiled.meshes);
+	writeArray(out, header.arrays[VERTICES_SECTION], compiled.vertices);
+	writeArray(out, header.arrays[INDICES_SECTION], compiled.indices);
+	writeArray(out, header.arrays[INSTANCES_SECTION], compiled.instances);
+
+	return bool(out);
+}
+
+/*
+map a binary scene file and use its arrays in place
+	path: file to map
+	compiled: output scene, which keeps the file mapped
+	j: output json scene, holding only the camera properties the file was made with
+	error: output description of what was wrong with the file
+	returns false if the file could not be mapped or was not made for this build
+*/
+bool mapSceneFile(const std::string &path, Scene &compiled, json &j, std::string &error) {
+	std::shared_ptr<MappedFile> file = mapFile(path);
+	if (file == NULL) {
+		error = "unable to map the file";
+		return false;
+	}
+
+	SceneFileHeader header;
+	if (file->size < sizeof(header)) {
+		error = "the file is too small";
+		return false;
+	}
+	memcpy(&header, file->data, sizeof(header));
+
+	if (memcmp(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic)) != 0) {
+		error = "not a binary scene file";
+		return false;
+	}
+	if (header.version != SCENE_FILE_VERSION || header.byteOrder != FILE_BYTE_ORDER_MARK) {
+		error = "made by a different version or for a different machine, convert the scene again";
+		return false;
+	}
+
+	compiled = Scene();
+	bool valid = viewArray(*file, header.arrays[MATERIALS_SECTION], compiled.materials)
+		&& viewArray(*file, header.arrays[SPHERES_SECTION], compiled.spheres)
+		&& viewArray(*file, header.arrays[PLANES_SECTION], compiled.planes)
+		&& viewArray(*file, header.arrays[TRIANGLES_SECTION], compiled.triangles)
+		&& viewArray(*file, header.arrays[LIGHTS_SECTION], compiled.lights)
+		&& viewArray(*file, header.arrays[MESHES_SECTION], compiled.meshes)
+		&& viewArray(*file, header.arrays[VERTICES_SECTION], compiled.vertices)
+		&& viewArray(*file, header.arrays[INDICES_SECTION], compiled.indices)
+		&& viewArray(*file, header.arrays[INSTANCES_SECTION], compiled.instances);
+	if (!valid) {
+		compiled = Scene();
+		error = "an array does not fit in the file or was written with a different layout";
+		return false;
+	}
+	compiled.file = file;
+
+	j = json::object();
+	json &camera = j["camera"] = json::object();
+	if (header.hasField) {
+		camera["field"] = header.field;
+	}
+	if (header.hasBackground) {
+		camera["background"] = { header.background[0], header.background[1], header.background[2] };
+	}
+
+	std::cout << "Mapped scene: " << compiled.spheres.size() << " spheres, " << compiled.planes.size() << " planes, "
+		<< compiled.triangles.size() << " triangles, " << compiled.instances.size() << " instances, " << compiled.lights.size() << " lights\n";
+	return true;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+// Binary scene files: the compiled arrays of a scene stored exactly as they are laid out in
+// memory, each starting on a FILE_ARRAY_ALIGNMENT boundary, so a file can be mapped and traced in place
+// without parsing or copying. Files are made from JSON scenes with the scenetool program.
+
+#include "scene.h"
+
+#include <cstdint>
+#include <string>
+
+const char SCENE_FILE_MAGIC[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', 0 };
+
+// raise whenever the header or any of the compiled structs change layout
+const uint32_t SCENE_FILE_VERSION = 2;
+
+enum SceneFileSection {
+	MATERIALS_SECTION,
+	SPHERES_SECTION,
+	PLANES_SECTION,
+	TRIANGLES_SECTION,
+	LIGHTS_SECTION,
+	MESHES_SECTION,
+	VERTICES_SECTION,
+	INDICES_SECTION,
+	INSTANCES_SECTION,
+	SCENE_FILE_SECTIONS
+};
+
+struct SceneFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder; // FILE_BYTE_ORDER_MARK as written by the machine that made the file
+
+	// the optional camera properties of the JSON scene
+	uint32_t hasField, hasBackground;
+	float field;
+	float background[3];
+
+	FileArray arrays[SCENE_FILE_SECTIONS];
+};
+
+bool writeSceneFile(const std::string &path, const Scene &compiled, json &camera);
+bool mapSceneFile(const std::string &path, Scene &compiled, json &j, std::string &error);
@@ -0,0 +1,61 @@
+// Converts JSON scenes into binary scene files that the renderers map instead of parsing.
+
+#include "scene.h"
+#include "scenefile.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+static void usage() {
+	std::cerr << "Usage: scenetool INPUT.json [OUTPUT.scene]\n"
+		<< "       scenetool SCENE (converts scenes/SCENE.json to scenes/SCENE.scene)\n";
+}
+
+static bool endsWith(const std::string &s, const std::string &suffix) {
+	return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2 || argc > 3) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	// a bare scene name refers to the renderers' scenes directory
+	std::string input = argv[1];
+	if (!endsWith(input, ".json")) {
+		input = "scenes/" + input + ".json";
+	}
+	std::string output = argc == 3 ? argv[2] : input.substr(0, input.size() - 5) + ".scene";
+
+	std::ifstream in(input);
+	if (!in.is_open()) {
+		std::cerr << "Unable to open scene file " << input << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	// mesh files are named relative to the scene
+	std::string directory = input.substr(0, input.find_last_of("/\\") + 1);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	json j;
+	Scene compiled;
+	std::string error;
+	if (!loadScene(in, directory, j, compiled, error)) {
+		std::cerr << "Unable to read scene file " << input << ": " << error << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	json camera = j["camera"];
+	if (!writeSceneFile(output, compiled, camera)) {
+		std::cerr << "Unable to write scene file " << output << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "Wrote " << output << " in " << seconds << "s\n";
+	return EXIT_SUCCESS;
+}
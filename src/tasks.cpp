@@ -0,0 +1,236 @@
+/*
+	Task pool
+	Worker threads are started on first use, one per hardware thread (the thread
+	that waits on a group helps run tasks, so it counts as one of them, unless
+	the program says its main thread never waits).
+
+	Every worker has its own deque of tasks. A worker pushes and pops the tasks it
+	queues at the back, so it keeps working on what it just split off, while idle
+	workers steal the oldest (and usually largest) tasks from the front of the
+	others. Threads that are not workers queue into a shared deque that every
+	worker steals from in order.
+*/
+
+#include "tasks.h"
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct Task {
+	std::function<void()> run;
+	TaskGroup *group;
+};
+
+// a deque of tasks, padded so workers locking neighbouring queues do not share a cache line
+struct TaskQueue {
+	std::mutex mutex;
+	std::deque<Task> tasks;
+	char padding[64];
+};
+
+struct Workers {
+	// queues[0] is shared by threads outside the pool, queues[i] belongs to worker i
+	std::vector<std::unique_ptr<TaskQueue>> queues;
+	std::vector<std::thread> threads;
+	std::atomic<int> queued; // tasks in all the queues
+
+	// idle threads sleep on this until a task is queued or a group finishes
+	std::mutex sleepMutex;
+	std::condition_variable wake;
+	std::atomic<bool> stopping; // set at exit, queued tasks are dropped from then on
+
+	Workers() : queued(0), stopping(false) {}
+
+	~Workers() {
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			stopping = true;
+		}
+		wake.notify_all();
+
+		for (size_t i = 0; i < threads.size(); i++) {
+			threads[i].join();
+		}
+	}
+};
+
+static Workers workers;
+static std::once_flag started;
+static int requestedCount = 0;
+static bool callerWaits = true;
+
+// index of this thread's queue, 0 for threads outside the pool
+thread_local int workerIndex = 0;
+
+/*
+take a task from this thread's own queue, or steal one from another queue
+	task: output task
+	returns false if every queue is empty
+*/
+static bool popTask(Task &task) {
+	if (workers.queued.load() == 0) {
+		return false;
+	}
+
+	int count = int(workers.queues.size());
+
+	// own tasks newest first
+	if (workerIndex > 0) {
+		TaskQueue &own = *workers.queues[workerIndex];
+		std::lock_guard<std::mutex> lock(own.mutex);
+
+		if (!own.tasks.empty()) {
+			task = own.tasks.back();
+			own.tasks.pop_back();
+			workers.queued--;
+			return true;
+		}
+	}
+
+	// the others' oldest first, starting with the shared queue
+	for (int i = 0; i < count; i++) {
+		if (i == workerIndex && i > 0)
+			continue;
+
+		TaskQueue &victim = *workers.queues[i];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+
+		if (!victim.tasks.empty()) {
+			task = victim.tasks.front();
+			victim.tasks.pop_front();
+			workers.queued--;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// wake sleeping threads, taking the sleep lock so a thread about to sleep cannot miss it
+static void wakeWorkers(bool all) {
+	{
+		std::lock_guard<std::mutex> lock(workers.sleepMutex);
+	}
+
+	if (all) {
+		workers.wake.notify_all();
+	}
+	else {
+		workers.wake.notify_one();
+	}
+}
+
+static void finishTask(Task &task) {
+	task.run();
+
+	// the last task of a group wakes its waiter
+	if (--task.group->pending == 0) {
+		wakeWorkers(true);
+	}
+}
+
+static void workerLoop(int index) {
+	workerIndex = index;
+
+	while (!workers.stopping) {
+		Task task;
+
+		if (popTask(task)) {
+			finishTask(task);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(workers.sleepMutex);
+		if (workers.stopping)
+			break;
+		if (workers.queued.load() == 0) {
+			workers.wake.wait(lock);
+		}
+	}
+}
+
+static void startWorkers() {
+	int count = requestedCount > 0 ? requestedCount : int(std::thread::hardware_concurrency());
+	if (count < 1) {
+		count = 1;
+	}
+
+	int threads = callerWaits ? count - 1 : count;
+
+	for (int i = 0; i <= threads; i++) {
+		workers.queues.push_back(std::unique_ptr<TaskQueue>(new TaskQueue()));
+	}
+
+	for (int i = 1; i <= threads; i++) {
+		workers.threads.push_back(std::thread(workerLoop, i));
+	}
+}
+
+/*
+choose how many threads run tasks, must be called before any task is queued
+	count: number of threads including the waiting thread (see setCallerWaits), 0 for one per hardware thread
+*/
+void setWorkerCount(int count) {
+	requestedCount = count;
+}
+
+/*
+choose whether the main thread counts as one of the threads running tasks, must be called
+before any task is queued; a main thread that polls its groups instead of waiting on them
+only runs tasks while it waits, so it needs a worker in its place
+	waits: false if the main thread mostly polls groups
+*/
+void setCallerWaits(bool waits) {
+	callerWaits = waits;
+}
+
+int workerCount() {
+	std::call_once(started, startWorkers);
+	return int(workers.threads.size()) + (callerWaits ? 1 : 0);
+}
+
+/*
+queue a task to run on the pool
+	group: group the task counts towards
+	task: function to run
+*/
+void runTask(TaskGroup &group, const std::function<void()> &task) {
+	std::call_once(started, startWorkers);
+
+	group.pending++;
+	{
+		TaskQueue &queue = *workers.queues[workerIndex];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		Task queued = { task, &group };
+		queue.tasks.push_back(queued);
+		workers.queued++;
+	}
+	wakeWorkers(false);
+}
+
+/*
+wait until every task in a group (including tasks they queued) has finished,
+running queued tasks on this thread in the meantime
+	group: group to wait for
+*/
+void waitTasks(TaskGroup &group) {
+	std::call_once(started, startWorkers);
+
+	while (group.pending > 0) {
+		Task task;
+
+		if (popTask(task)) {
+			finishTask(task);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(workers.sleepMutex);
+		if (group.pending > 0 && workers.queued.load() == 0) {
+			workers.wake.wait(lock);
+		}
+	}
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+// A small pool of worker threads that runs queued tasks, each worker stealing from the
+// others when it runs out. Tasks are tracked by a TaskGroup so the caller can wait for a
+// batch of them (and any tasks they spawn).
+
+#include <atomic>
+#include <functional>
+
+struct TaskGroup {
+	std::atomic<int> pending;
+
+	TaskGroup() : pending(0) {}
+};
+
+void setWorkerCount(int count);
+void setCallerWaits(bool waits);
+int workerCount();
+void runTask(TaskGroup &group, const std::function<void()> &task);
+void waitTasks(TaskGroup &group);
@@ -1,11 +1,10 @@
 #version 150
 
-in vec3 vPos;
-uniform vec2 Window;
-out float u;
+in vec2 vPos;
+out vec2 uv;
 
 void main()
 {
-   gl_Position = vec4((vPos.x+0.5) * 2 / Window.x - 1, (vPos.y+0.5) * 2 / Window.y - 1, 0, 1);
-   u = vPos.z;
+   gl_Position = vec4(vPos, 0, 1);
+   uv = (vPos + 1) * 0.5;
 }
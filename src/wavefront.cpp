@@ -0,0 +1,298 @@
+/*
+	Wavefront ray tracing
+	Traces a stream of primary rays one bounce at a time. Every wave of rays is
+	intersected together, then their shadow rays, and the reflected and refracted
+	rays they spawn are queued as the next wave. Colours are combined from the
+	deepest wave back up once every wave has been traced.
+*/
+
+#include "wavefront.h"
+#include "raytracer.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+
+WavefrontMode wavefrontMode = WAVEFRONT_OFF;
+
+// A ray of the stream along with what it hit and which rays it spawned
+struct StreamRay {
+	point3 e, s;
+	float ni;
+	int iterations;
+	glm::vec3 weight; // contribution of the ray to the pixel
+	uint32_t key; // sort key of the ray (direction octant and origin)
+
+	int parent; // ray that spawned this one, -1 for primary rays
+	bool fromReflection; // spawned by the parent's reflection (otherwise by its transmission)
+
+	Hit hit;
+	bool found;
+	colour3 colour; // lit colour of the hit, then the final colour once combined
+
+	int reflected; // reflected ray, -1 if the background is reflected
+	int transmitted; // refracted or transparent ray, -1 if the background is seen through
+	bool internal; // transmitted is a total internal reflection (added instead of blended)
+};
+
+// A shadow ray from a hit point towards one light
+struct ShadowRay {
+	point3 p, target;
+	int ray;
+	int light;
+	uint32_t key;
+};
+
+// spread the low 10 bits of x so there are two zero bits between each
+static uint32_t spreadBits(uint32_t x) {
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x030000ff;
+	x = (x | (x << 8)) & 0x0300f00f;
+	x = (x | (x << 4)) & 0x030c30c3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+// morton code of a point within the scene's bounds, so nearby points sort next to each other
+static uint32_t mortonCode(const point3 &p) {
+	if (scene.bvh.nodes.empty())
+		return 0;
+
+	const AABB &bounds = scene.bvh.nodes[0].bounds;
+	glm::vec3 cell = (p - bounds.min) / glm::max(bounds.max - bounds.min, glm::vec3(1e-6f)) * 1023.0f;
+	cell = glm::clamp(cell, glm::vec3(0.0f), glm::vec3(1023.0f));
+
+	return spreadBits(uint32_t(cell.x)) | (spreadBits(uint32_t(cell.y)) << 1) | (spreadBits(uint32_t(cell.z)) << 2);
+}
+
+// sort key of a ray, grouping rays by the octant of their direction and then by origin
+static uint32_t rayKey(const point3 &e, const point3 &s) {
+	glm::vec3 d = s - e;
+	uint32_t octant = (d.x < 0 ? 1 : 0) | (d.y < 0 ? 2 : 0) | (d.z < 0 ? 4 : 0);
+	return (octant << 29) | (mortonCode(e) >> 1);
+}
+
+// queue a ray spawned by the reflection or transmission of rays[parent]
+static int spawnRay(std::vector<StreamRay> &rays, int parent, bool fromReflection, const point3 &e, const point3 &s, float ni, int iterations, const glm::vec3 &weight) {
+	// shade stops when no iterations are left, which shows the background
+	if (iterations <= 0)
+		return -1;
+
+	// so does a ray that can barely change the pixel
+	if (glm::max(weight.x, glm::max(weight.y, weight.z)) < minContribution) {
+		countRays(0, 1);
+		return -1;
+	}
+
+	StreamRay ray;
+	ray.e = e;
+	ray.s = s;
+	ray.ni = ni;
+	ray.iterations = iterations;
+	ray.weight = weight;
+	ray.key = wavefrontMode == WAVEFRONT_SORTED ? rayKey(e, s) : 0;
+	ray.parent = parent;
+	ray.fromReflection = fromReflection;
+	ray.found = false;
+	ray.reflected = -1;
+	ray.transmitted = -1;
+	ray.internal = false;
+
+	rays.push_back(ray);
+	return int(rays.size()) - 1;
+}
+
+// colour a parent sees along a spawned ray
+static colour3 spawnedColour(const std::vector<StreamRay> &rays, int ray) {
+	if (ray < 0 || !rays[ray].found)
+		return background_colour;
+
+	return glm::clamp(rays[ray].colour, 0.0f, 1.0f);
+}
+
+/*
+trace the shadow rays of every hit in a wave, in one batch
+	rays: rays of the stream
+	begin, end: range of the wave in rays
+	lit: output whether each light reaches each hit of the wave, indexed by (ray - begin) * lights + light
+*/
+static void traceShadows(const std::vector<StreamRay> &rays, int begin, int end, bool *lit) {
+	size_t lights = scene.lights.size();
+	std::vector<ShadowRay> shadows;
+
+	for (int i = begin; i < end; i++) {
+		const StreamRay &ray = rays[i];
+		if (!ray.found)
+			continue;
+
+		point3 p = ray.e + (ray.s - ray.e) * ray.hit.t;
+
+		for (size_t j = 0; j < lights; j++) {
+			const Light &light = scene.lights[j];
+			lit[(i - begin) * lights + j] = false;
+
+			glm::vec3 l;
+			point3 target;
+			if (light.type == AMBIENT_LIGHT || !lightRay(light, p, l, target))
+				continue;
+
+			ShadowRay shadow;
+			shadow.p = p;
+			shadow.target = target;
+			shadow.ray = i;
+			shadow.light = int(j);
+			shadow.key = wavefrontMode == WAVEFRONT_SORTED ? mortonCode(p) : 0;
+			shadows.push_back(shadow);
+		}
+	}
+
+	// rays towards the same light from nearby points tend to hit the same occluders
+	if (wavefrontMode == WAVEFRONT_SORTED) {
+		std::sort(shadows.begin(), shadows.end(), [](const ShadowRay &a, const ShadowRay &b) {
+			return a.light != b.light ? a.light < b.light : a.key < b.key;
+		});
+	}
+
+	for (size_t i = 0; i < shadows.size(); i++) {
+		const ShadowRay &shadow = shadows[i];
+		lit[(shadow.ray - begin) * lights + shadow.light] = !pointInShadow(shadow.p, shadow.target, shadow.light);
+	}
+}
+
+/*
+light the hits of a wave and queue the rays they reflect and transmit as the next wave
+	rays: rays of the stream
+	begin, end: range of the wave in rays
+	lit: whether each light reaches each hit of the wave
+*/
+static void shadeWave(std::vector<StreamRay> &rays, int begin, int end, const bool *lit) {
+	size_t lights = scene.lights.size();
+
+	for (int i = begin; i < end; i++) {
+		if (!rays[i].found)
+			continue;
+
+		// copied since spawning rays can move the stream
+		StreamRay ray = rays[i];
+		point3 p = ray.e + (ray.s - ray.e) * ray.hit.t;
+		glm::vec3 n = ray.hit.normal;
+		const Material &material = scene.materials[ray.hit.material];
+
+		rays[i].colour = glm::clamp(light(ray.e, p, n, material, lit + (i - begin) * lights), 0.0f, 1.0f);
+
+		if (material.hasReflective) {
+			int reflected = spawnRay(rays, i, true, p, p + reflectDirection(ray.e, p, n), -1.0f, ray.iterations - 1, ray.weight * material.reflective);
+			rays[i].reflected = reflected;
+		}
+
+		if (material.hasTransmissive) {
+			int transmitted;
+
+			if (!material.hasRefraction) {
+				transmitted = spawnRay(rays, i, false, p, p + (ray.s - ray.e), -1.0f, ray.iterations - 1, ray.weight * material.transmissive);
+			}
+			else {
+				glm::vec3 vr;
+				float nextNi;
+
+				if (refractDirection(ray.e, ray.s, n, ray.ni, material.refraction, vr, nextNi)) {
+					transmitted = spawnRay(rays, i, false, p, p + vr, nextNi, ray.iterations - 1, ray.weight * material.transmissive);
+				}
+				else {
+					// a total internal reflection is followed with one iteration less
+					transmitted = spawnRay(rays, i, false, p, p + reflectDirection(ray.e, p, n), -1.0f, ray.iterations - 2, ray.weight);
+					rays[i].internal = true;
+				}
+			}
+
+			rays[i].transmitted = transmitted;
+		}
+	}
+}
+
+/*
+sort a wave so rays going the same way from nearby origins are traced together
+	rays: rays of the stream
+	begin, end: range of the wave in rays
+*/
+static void sortWave(std::vector<StreamRay> &rays, int begin, int end) {
+	std::stable_sort(rays.begin() + begin, rays.begin() + end, [](const StreamRay &a, const StreamRay &b) {
+		return a.key < b.key;
+	});
+
+	// the parents are in earlier waves and have to follow their rays
+	for (int i = begin; i < end; i++) {
+		StreamRay &parent = rays[rays[i].parent];
+		(rays[i].fromReflection ? parent.reflected : parent.transmitted) = i;
+	}
+}
+
+/*
+trace a stream of rays that share an origin one bounce at a time (gives the same colours as trace
+without russian roulette)
+	e: shared start point of the rays
+	s: intersection point of each ray
+	count: number of rays
+	colours: output colour of each ray
+	primitives: output primitive each ray hit first, -1 if it hit nothing
+*/
+void traceStream(const point3 &e, const point3 *s, int count, colour3 *colours, int *primitives) {
+	std::vector<StreamRay> rays;
+	rays.reserve(count * 2);
+
+	for (int i = 0; i < count; i++) {
+		spawnRay(rays, -1, false, e, s[i], -1.0f, MAX_RAY_DEPTH, glm::vec3(1.0f, 1.0f, 1.0f));
+	}
+
+	int begin = 0;
+	int end = int(rays.size());
+
+	while (begin < end) {
+		if (wavefrontMode == WAVEFRONT_SORTED && begin > 0) {
+			sortWave(rays, begin, end);
+		}
+
+		for (int i = begin; i < end; i++) {
+			StreamRay &ray = rays[i];
+			ray.found = intersect(ray.e, ray.s, ray.hit);
+		}
+		countRays(end - begin, 0);
+
+		std::unique_ptr<bool[]> lit(new bool[(end - begin) * scene.lights.size() + 1]);
+		traceShadows(rays, begin, end, lit.get());
+		shadeWave(rays, begin, end, lit.get());
+
+		begin = end;
+		end = int(rays.size());
+	}
+
+	// spawned rays always come after their parent, so going backwards finishes every ray before its parent
+	for (int i = int(rays.size()) - 1; i >= 0; i--) {
+		StreamRay &ray = rays[i];
+		if (!ray.found)
+			continue;
+
+		const Material &material = scene.materials[ray.hit.material];
+
+		if (material.hasReflective) {
+			ray.colour = glm::clamp(ray.colour + spawnedColour(rays, ray.reflected) * material.reflective, 0.0f, 1.0f);
+		}
+
+		if (material.hasTransmissive) {
+			colour3 seen = spawnedColour(rays, ray.transmitted);
+
+			if (ray.internal) {
+				ray.colour = glm::clamp(ray.colour + seen, 0.0f, 1.0f);
+			}
+			else {
+				glm::vec3 kt = material.transmissive;
+				ray.colour = glm::clamp((1.0f - kt) * ray.colour + seen * kt, 0.0f, 1.0f);
+			}
+		}
+	}
+
+	for (int i = 0; i < count; i++) {
+		primitives[i] = rays[i].found ? rays[i].hit.primitive : -1;
+		colours[i] = rays[i].colour;
+	}
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+// Breadth-first (wavefront) tracing. Instead of following each ray's reflections and
+// refractions depth first, all rays of one bounce are intersected together, their
+// shadow rays are traced as a batch, and the rays they spawn form the next wave.
+
+#include "scene.h"
+
+enum WavefrontMode { WAVEFRONT_OFF, WAVEFRONT_ON, WAVEFRONT_SORTED };
+
+extern WavefrontMode wavefrontMode;
+
+void traceStream(const point3 &e, const point3 *s, int count, colour3 *colours, int *primitives);
@@ -0,0 +1,157 @@
+"""Render every bundled scene through headless with each rendering option on and off, and
+check that the images match the default render.
+
+Usage: python tools/compare_renders.py HEADLESS [--size=WIDTHxHEIGHT] [--keep=DIRECTORY]
+
+HEADLESS is the built headless executable. Scenes are read from src/scenes, and every option
+below must give the same image as the default settings, byte for byte unless a tolerance is
+given. Each scene is checked without and with anti-aliasing. The script exits with status 1
+if any image differs.
+
+Where two surfaces nearly coincide (the checkerboard of scenes/i.json lies 0.001 above its
+floor), which one is closest depends on rounding and on the order triangles are tested in.
+So one pixel in every TIE_PIXELS may differ by more than the tolerance.
+"""
+
+import glob
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+TIE_PIXELS = 10000
+
+# options that change how the image is traced but not what it shows, with the largest
+# difference allowed in any channel (out of 255) and whether to check them with anti-aliasing
+VARIANTS = [
+    (["--triangle-blocks=off"], 0, True),
+    (["--occluder-cache=off"], 0, True),
+    (["--packets=off"], 0, True),
+    (["--packets=4"], 0, True),
+    (["--packets=8"], 0, True),
+    (["--wavefront=on"], 0, True),
+    (["--wavefront=sorted"], 0, True),
+    (["--bvh-width=2"], 0, True),
+    (["--bvh-width=4"], 0, True),
+    (["--bvh-width=8"], 0, True),
+    (["--bvh-builder=sweep"], 0, True),
+    (["--bvh-builder=binned"], 0, True),
+    (["--band-rows=1"], 0, True),
+    (["--band-rows=7"], 0, True),
+    (["--threads=1"], 0, True),
+    (["--threads=4"], 0, True),
+    (["--tile-size=7"], 0, True),
+    # halves round each channel to 11 bits before it is written as 8; the edge pass reads
+    # the rounded pixels, so with anti-aliasing it takes different samples
+    (["--pixel-format=half"], 1, False),
+]
+
+# every scene is rendered with each of these settings alone and with each variant added
+SETTINGS = [
+    [],
+    ["--aa-samples=4"],
+]
+
+
+def read_ppm(path):
+    """Return the width, height and RGB bytes of a binary PPM written by headless."""
+    with open(path, "rb") as f:
+        data = f.read()
+    fields = []
+    position = 0
+    while len(fields) < 4:
+        while data[position:position + 1].isspace():
+            position += 1
+        start = position
+        while not data[position:position + 1].isspace():
+            position += 1
+        fields.append(data[start:position])
+    if fields[0] != b"P6" or fields[3] != b"255":
+        raise ValueError(path + " is not an 8 bit binary PPM")
+    return int(fields[1]), int(fields[2]), data[position + 1:]
+
+
+def difference(a, b, tolerance):
+    """Return the number of pixels that differ by more than the tolerance in any channel, and
+    the largest difference."""
+    width_a, height_a, pixels_a = read_ppm(a)
+    width_b, height_b, pixels_b = read_ppm(b)
+    if (width_a, height_a) != (width_b, height_b):
+        return width_a * height_a, 255
+
+    pixels = 0
+    largest = 0
+    for i in range(0, len(pixels_a), 3):
+        d = max(abs(pixels_a[i + k] - pixels_b[i + k]) for k in range(3))
+        if d > tolerance:
+            pixels += 1
+            largest = max(largest, d)
+    return pixels, largest
+
+
+def render(headless, scenes, scene, size, options, output):
+    # headless looks for scenes/NAME.json, so it runs from the source directory
+    command = [headless, scene, "--size=" + size, "--output=" + output, "--bvh-cache=off"] + options
+    result = subprocess.run(command, cwd=os.path.dirname(scenes), stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    if result.returncode != 0:
+        raise RuntimeError(" ".join(command) + " failed: " + result.stderr.decode(errors="replace"))
+
+
+def main(argv):
+    if len(argv) < 2 or argv[1].startswith("--"):
+        print(__doc__.strip().splitlines()[3], file=sys.stderr)
+        return 2
+
+    headless = os.path.abspath(argv[1])
+    size = "160x120"
+    keep = None
+    for arg in argv[2:]:
+        if arg.startswith("--size="):
+            size = arg[len("--size="):]
+        elif arg.startswith("--keep="):
+            keep = os.path.abspath(arg[len("--keep="):])
+        else:
+            print("Unknown option " + arg, file=sys.stderr)
+            return 2
+    width, height = (int(n) for n in size.split("x"))
+
+    scenes = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "src", "scenes")
+    scenes = os.path.normpath(scenes)
+    names = sorted(os.path.splitext(os.path.basename(p))[0] for p in glob.glob(os.path.join(scenes, "*.json")))
+
+    directory = keep if keep is not None else tempfile.mkdtemp(prefix="compare_renders")
+    os.makedirs(directory, exist_ok=True)
+    failures = 0
+    compared = 0
+
+    try:
+        for name in names:
+            for settings in SETTINGS:
+                label = name + (" " + " ".join(settings) if settings else "")
+                stem = os.path.join(directory, name + "".join(s.replace("=", "").replace("-", "_") for s in settings))
+                base = stem + ".ppm"
+                render(headless, scenes, name, size, settings, base)
+
+                for options, tolerance, anti_aliased in VARIANTS:
+                    if settings and not anti_aliased:
+                        continue
+
+                    variant = stem + "".join(o.replace("=", "").replace("-", "_") for o in options) + ".ppm"
+                    render(headless, scenes, name, size, settings + options, variant)
+                    pixels, largest = difference(base, variant, tolerance)
+                    compared += 1
+
+                    if pixels > max(1, width * height // TIE_PIXELS):
+                        failures += 1
+                        print("DIFFERENT %s %s: %d pixels, up to %d" % (label, " ".join(options), pixels, largest))
+    finally:
+        if keep is None:
+            shutil.rmtree(directory)
+
+    print("%d renders of %d scenes compared, %d different" % (compared, len(names), failures))
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))